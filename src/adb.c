@@ -0,0 +1,269 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loader for "ASCII database" (.adb) files.
+ *
+ * These are the output of "ultraeasy --dump" as merged by ue-dbupdate, one
+ * reading per line:
+ *
+ *   2011-09-05 13:41:41    10.9 mmol/l
+ *
+ * The file is memory mapped and cut into chunks at line boundaries, each of
+ * which is parsed by its own thread. Every field is at a fixed offset (apart
+ * from the reading, which is padded to the left) so the parser is a handful
+ * of digit conversions rather than sscanf()/strptime()/strtod(). Lines that
+ * do not have this layout are skipped, as ue-dbupdate does.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ultraeasy.h"
+#include "util.h"
+
+/* the shortest line we can parse ("YYYY-MM-DD HH:MM:SS 0.0 mmol/l") */
+#define MIN_LINE_LEN 30
+
+/* do not bother with another thread for less than this much of the file */
+#define MIN_CHUNK_LEN (256 * 1024)
+
+#define MAX_THREADS 64
+
+typedef struct chunk {
+	const char *start;
+	const char *end;
+
+	ultraeasy_record_t *records;
+	unsigned long num_records;
+	unsigned long skipped;
+} chunk_t;
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline int two_digits(const char *p)
+{
+	return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+/**
+ * Parse one line (which runs from p up to, but not including, end).
+ *
+ * Returns false if the line does not hold a reading.
+ */
+static bool parse_line(const char *p, const char *end, ultraeasy_record_t *record)
+{
+	static const char layout[] = "dddd-dd-dd dd:dd:dd";
+	static const char units[] = " mmol/l";
+
+	if (end - p < MIN_LINE_LEN)
+		return false;
+
+	for (int i=0; i<sizeof(layout) - 1; i++) {
+		if ('d' == layout[i] ? !is_digit(p[i]) : p[i] != layout[i])
+			return false;
+	}
+
+	int year = two_digits(p) * 100 + two_digits(p + 2);
+	int month = two_digits(p + 5);
+	int day = two_digits(p + 8);
+	int hour = two_digits(p + 11);
+	int min = two_digits(p + 14);
+	int sec = two_digits(p + 17);
+	if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 59)
+		return false;
+
+	// the reading, in tenths of a mmol/l
+	p += sizeof(layout) - 1;
+	while (p < end && ' ' == *p)
+		p++;
+
+	uint32_t tenths = 0;
+	const char *digits = p;
+	while (p < end && is_digit(*p) && p - digits < 6)
+		tenths = tenths * 10 + (*p++ - '0');
+	if (p == digits || end - p < 2 || '.' != p[0] || !is_digit(p[1]))
+		return false;
+	tenths = tenths * 10 + (p[1] - '0');
+	p += 2;
+
+	if (end - p < sizeof(units) - 1 || 0 != memcmp(p, units, sizeof(units) - 1))
+		return false;
+	p += sizeof(units) - 1;
+	if (p < end && '\r' == *p)
+		p++;
+	if (p != end)
+		return false;
+
+	// the meter records mg/dL which the dump divided by 18 (and rounded)
+	time_t date = utc_time(year, month, day, hour, min, sec);
+	if (date < 0 || date > UINT32_MAX)
+		return false;
+	ultraeasy_record_from_raw(record, date, (tenths * 18 + 5) / 10);
+	return true;
+}
+
+static void *parse_chunk(void *arg)
+{
+	chunk_t *chunk = arg;
+	const char *p = chunk->start;
+
+	// every reading needs at least a line of MIN_LINE_LEN (plus a newline)
+	unsigned long max = (chunk->end - chunk->start) / (MIN_LINE_LEN + 1) + 1;
+	chunk->records = xzalloc(max * sizeof(ultraeasy_record_t));
+
+	while (p < chunk->end) {
+		const char *eol = memchr(p, '\n', chunk->end - p);
+		if (!eol)
+			eol = chunk->end;
+
+		if (parse_line(p, eol, &chunk->records[chunk->num_records]))
+			chunk->num_records++;
+		else if (eol != p)
+			chunk->skipped++;
+
+		p = eol + 1;
+	}
+
+	return NULL;
+}
+
+/**
+ * Load every reading from an .adb file.
+ *
+ * The file is parsed by up to threads threads (or one per processor if
+ * threads is zero). The readings are returned in file order as a malloc'ed
+ * array (or NULL, with errno set, on error). Since the file records readings
+ * in mmol/l (to one decimal place) the raw reading is the nearest mg/dL
+ * value, which may differ by one from what the meter reported.
+ */
+ultraeasy_record_t *ultraeasy_load_adb(const char *pathname, unsigned int threads,
+				       unsigned long *num_records)
+{
+	struct stat st;
+	int error;
+
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (0 != fstat(fd, &st)) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+
+	// mmap() cannot map an empty file
+	if (0 == st.st_size) {
+		close(fd);
+		*num_records = 0;
+		return xzalloc(sizeof(ultraeasy_record_t));
+	}
+
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	error = errno;
+	close(fd);
+	if (MAP_FAILED == map) {
+		errno = error;
+		return NULL;
+	}
+	(void) posix_madvise((void *) map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	if (0 == threads) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? online : 1;
+	}
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if (threads > st.st_size / MIN_CHUNK_LEN)
+		threads = st.st_size / MIN_CHUNK_LEN ? st.st_size / MIN_CHUNK_LEN : 1;
+
+	// cut the file into chunks that end just after a newline
+	chunk_t chunks[MAX_THREADS];
+	unsigned int num_chunks = 0;
+	const char *p = map, *end = map + st.st_size;
+	while (p < end) {
+		const char *split = p + (end - p) / (threads - num_chunks);
+		if (num_chunks == threads - 1)
+			split = end;
+
+		const char *eol = memchr(split, '\n', end - split);
+		split = eol ? eol + 1 : end;
+
+		chunk_t *chunk = &chunks[num_chunks++];
+		memset(chunk, 0, sizeof(*chunk));
+		chunk->start = p;
+		chunk->end = split;
+		p = split;
+
+		if (num_chunks == threads)
+			break;
+	}
+
+	// parse all but the first chunk in new threads (and the first ourselves)
+	pthread_t workers[MAX_THREADS];
+	bool started[MAX_THREADS] = { false };
+	for (unsigned int i=1; i<num_chunks; i++)
+		started[i] = 0 == pthread_create(&workers[i], NULL, parse_chunk, &chunks[i]);
+
+	parse_chunk(&chunks[0]);
+
+	unsigned long total = 0, skipped = 0;
+	for (unsigned int i=0; i<num_chunks; i++) {
+		if (i && started[i])
+			pthread_join(workers[i], NULL);
+		else if (i)
+			parse_chunk(&chunks[i]);
+
+		total += chunks[i].num_records;
+		skipped += chunks[i].skipped;
+	}
+
+	munmap((void *) map, st.st_size);
+
+	// the first chunk's array becomes the result
+	ultraeasy_record_t *records = xrealloc(chunks[0].records,
+					       (total ? total : 1) * sizeof(ultraeasy_record_t));
+	unsigned long n = chunks[0].num_records;
+	for (unsigned int i=1; i<num_chunks; i++) {
+		memcpy(records + n, chunks[i].records,
+		       chunks[i].num_records * sizeof(ultraeasy_record_t));
+		n += chunks[i].num_records;
+		free(chunks[i].records);
+	}
+
+	DEBUG("Loaded %lu readings from %s using %u threads (skipped %lu lines)\n",
+			total, pathname, num_chunks, skipped);
+
+	*num_records = total;
+	return records;
+}
@@ -0,0 +1,861 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading archives.
+ *
+ * An archive is a read-only, columnar copy of the readings from any number
+ * of meters. It is laid out to be memory mapped and scanned quickly:
+ *
+ *   header    (8 bytes, "UEARC", a NUL, the format version and another NUL)
+ *   blocks    (the readings)
+ *   meters    (per meter: serial length (1 byte) and serial)
+ *   directory (per block, see below)
+ *   trailer   (meters offset (8 bytes), directory offset (8 bytes), number
+ *              of meters (4 bytes) and number of blocks (4 bytes))
+ *
+ * Each block holds up to ARCHIVE_BLOCK_READINGS readings from one meter in
+ * date order. The dates are stored as varint encoded deltas from the first
+ * date (which is kept in the directory) and are followed by the readings,
+ * less the smallest reading, bit-packed at the width needed for the
+ * largest. A directory entry is:
+ *
+ *   meter (2 bytes), width (1 byte), reserved (1 byte), count (4 bytes),
+ *   min date (4 bytes), max date (4 bytes), min reading (4 bytes),
+ *   max reading (4 bytes), offset (8 bytes), date length (4 bytes)
+ *
+ * Blocks appear in meter order and then date order so the min/max headers
+ * double as a sparse index: a query looks up the meter's run of blocks,
+ * binary searches it for the first block that can hold the start of the
+ * time range and stops at the first block that starts after its end.
+ * All values are little endian.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ultraeasy.h"
+#include "util.h"
+
+#define ARCHIVE_VERSION 1
+
+static const unsigned char header[8] = { 'U', 'E', 'A', 'R', 'C', 0, ARCHIVE_VERSION, 0 };
+
+/* the number of readings in a (full) block */
+#define ARCHIVE_BLOCK_READINGS 1024
+
+/* the worst case size of an encoded block (5 byte varints and 32-bit readings) */
+#define BLOCK_MAX_LEN (ARCHIVE_BLOCK_READINGS * (5 + 4))
+
+#define DIRECTORY_ENTRY_LEN 36
+#define TRAILER_LEN 24
+
+/* meters are numbered with 16 bits and the serial length is a single byte */
+#define MAX_METERS 0xffff
+#define MAX_SERIAL_LEN 0xff
+
+typedef struct raw_reading {
+	uint32_t date;
+	uint32_t reading;
+} raw_reading_t;
+
+typedef struct archive_block {
+	unsigned int meter;
+	unsigned int width;
+	unsigned int count;
+	uint32_t min_date;
+	uint32_t max_date;
+	uint32_t min_reading;
+	uint32_t max_reading;
+	uint64_t offset;
+	uint32_t date_len;
+} archive_block_t;
+
+typedef struct writer_meter {
+	char *serial;
+	raw_reading_t *readings;
+	unsigned long num_readings;
+	unsigned long max_readings;
+} writer_meter_t;
+
+struct ultraeasy_archive_writer {
+	char *pathname;
+
+	writer_meter_t *meters;
+	unsigned int num_meters;
+	unsigned int max_meters;
+	unsigned int last_meter;	// the most recently used meter (a lookup cache)
+};
+
+struct ultraeasy_archive {
+	const unsigned char *map;
+	size_t size;
+
+	char **meters;
+	unsigned int num_meters;
+
+	archive_block_t *blocks;
+	unsigned int num_blocks;
+
+	// each meter's run of blocks (the first block and one past the last)
+	unsigned int *meter_start;
+	unsigned int *meter_end;
+};
+
+/**
+ * Create an archive.
+ *
+ * Nothing is written until ultraeasy_archive_finish() is called (the
+ * readings are sorted first) and the archive only appears, complete, when
+ * that succeeds.
+ */
+ultraeasy_archive_writer_t *ultraeasy_archive_create(const char *pathname)
+{
+	ultraeasy_archive_writer_t *w = xzalloc(sizeof(ultraeasy_archive_writer_t));
+	w->pathname = xstrdup(pathname);
+
+	return w;
+}
+
+static writer_meter_t *find_meter(ultraeasy_archive_writer_t *w, const char *serial)
+{
+	if (w->last_meter < w->num_meters && 0 == strcmp(w->meters[w->last_meter].serial, serial))
+		return &w->meters[w->last_meter];
+
+	for (unsigned int i=0; i<w->num_meters; i++) {
+		if (0 == strcmp(w->meters[i].serial, serial)) {
+			w->last_meter = i;
+			return &w->meters[i];
+		}
+	}
+
+	if (strlen(serial) > MAX_SERIAL_LEN || w->num_meters >= MAX_METERS) {
+		errno = E2BIG;
+		return NULL;
+	}
+
+	if (w->num_meters == w->max_meters) {
+		w->max_meters = w->max_meters ? 2 * w->max_meters : 8;
+		w->meters = xrealloc(w->meters, w->max_meters * sizeof(writer_meter_t));
+	}
+
+	writer_meter_t *m = &w->meters[w->num_meters];
+	memset(m, 0, sizeof(*m));
+	m->serial = xstrdup(serial);
+
+	w->last_meter = w->num_meters++;
+	return m;
+}
+
+/**
+ * Add a reading to an archive that is being created.
+ */
+int ultraeasy_archive_write(ultraeasy_archive_writer_t *w, const char *serial,
+			    const ultraeasy_record_t *record)
+{
+	writer_meter_t *m = find_meter(w, serial);
+	if (NULL == m)
+		return -1;
+
+	if (m->num_readings == m->max_readings) {
+		m->max_readings = m->max_readings ? 2 * m->max_readings : 1024;
+		m->readings = xrealloc(m->readings, m->max_readings * sizeof(raw_reading_t));
+	}
+
+	m->readings[m->num_readings].date = record->raw.date;
+	m->readings[m->num_readings].reading = record->raw.reading;
+	m->num_readings++;
+	return 0;
+}
+
+static int compare_readings(const void *a, const void *b)
+{
+	const raw_reading_t *x = a;
+	const raw_reading_t *y = b;
+
+	if (x->date != y->date)
+		return x->date < y->date ? -1 : 1;
+	if (x->reading != y->reading)
+		return x->reading < y->reading ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Sort a meter's readings into date order and drop any duplicates.
+ */
+static void sort_readings(writer_meter_t *m)
+{
+	unsigned long n = 0;
+
+	qsort(m->readings, m->num_readings, sizeof(raw_reading_t), compare_readings);
+
+	for (unsigned long i=0; i<m->num_readings; i++)
+		if (0 == n || 0 != compare_readings(&m->readings[n - 1], &m->readings[i]))
+			m->readings[n++] = m->readings[i];
+
+	m->num_readings = n;
+}
+
+static unsigned int bit_width(uint32_t v)
+{
+	unsigned int width = 0;
+
+	while (v) {
+		width++;
+		v >>= 1;
+	}
+
+	return width;
+}
+
+/**
+ * Encode a block of (sorted) readings.
+ *
+ * The directory entry is filled in apart from the meter and the offset.
+ * Returns the number of bytes placed in buf (which must be big enough for
+ * the worst case, see BLOCK_MAX_LEN).
+ */
+static size_t encode_block(const raw_reading_t *r, unsigned int count,
+			   archive_block_t *block, unsigned char *buf)
+{
+	unsigned char *p = buf;
+
+	block->count = count;
+	block->min_date = r[0].date;
+	block->max_date = r[count - 1].date;
+	block->min_reading = block->max_reading = r[0].reading;
+	for (unsigned int i=1; i<count; i++) {
+		if (r[i].reading < block->min_reading)
+			block->min_reading = r[i].reading;
+		if (r[i].reading > block->max_reading)
+			block->max_reading = r[i].reading;
+	}
+	block->width = bit_width(block->max_reading - block->min_reading);
+
+	// dates (the first is implied by min_date)
+	for (unsigned int i=1; i<count; i++) {
+		uint32_t delta = r[i].date - r[i - 1].date;
+		while (delta >= 0x80) {
+			*p++ = delta | 0x80;
+			delta >>= 7;
+		}
+		*p++ = delta;
+	}
+	block->date_len = p - buf;
+
+	// readings
+	uint64_t acc = 0;
+	unsigned int bits = 0;
+	for (unsigned int i=0; i<count; i++) {
+		acc |= (uint64_t) (r[i].reading - block->min_reading) << bits;
+		bits += block->width;
+		while (bits >= 8) {
+			*p++ = acc;
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+	if (bits)
+		*p++ = acc;
+
+	return p - buf;
+}
+
+static void free_writer(ultraeasy_archive_writer_t *w)
+{
+	for (unsigned int i=0; i<w->num_meters; i++) {
+		free(w->meters[i].serial);
+		free(w->meters[i].readings);
+	}
+	free(w->meters);
+	free(w->pathname);
+	free(w);
+}
+
+/**
+ * Flush the directory holding pathname to disk (making a rename durable).
+ */
+static int sync_directory(const char *pathname)
+{
+	const char *slash = strrchr(pathname, '/');
+	char *dir = slash ? xstrdup_printf("%.*s", (int) (slash - pathname) + 1, pathname)
+			  : xstrdup(".");
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd < 0)
+		return -1;
+
+	// some filesystems cannot sync a directory (and have no need to)
+	int res = fsync(fd);
+	if (0 != res && EINVAL == errno)
+		res = 0;
+
+	int error = errno;
+	close(fd);
+	errno = error;
+	return res;
+}
+
+/**
+ * Write the archive and free the writer.
+ *
+ * The archive is written under a temporary name, flushed to disk and then
+ * renamed into place (and the rename itself flushed) so that a crash cannot
+ * leave a partially written archive behind.
+ */
+int ultraeasy_archive_finish(ultraeasy_archive_writer_t *w)
+{
+	unsigned char *buf = xzalloc(BLOCK_MAX_LEN);
+	archive_block_t *blocks = NULL;
+	unsigned int num_blocks = 0, max_blocks = 0;
+	uint64_t offset = 0;
+	unsigned char entry[DIRECTORY_ENTRY_LEN];
+	int error;
+
+	char *tmp = xstrdup_printf("%s.tmp", w->pathname);
+	FILE *f = fopen(tmp, "wb");
+	if (NULL == f)
+		goto handle_error;
+
+	if (1 != fwrite(header, sizeof(header), 1, f))
+		goto handle_error;
+	offset = sizeof(header);
+
+	for (unsigned int i=0; i<w->num_meters; i++) {
+		writer_meter_t *m = &w->meters[i];
+
+		sort_readings(m);
+
+		for (unsigned long j=0; j<m->num_readings; j+=ARCHIVE_BLOCK_READINGS) {
+			unsigned long count = m->num_readings - j;
+			if (count > ARCHIVE_BLOCK_READINGS)
+				count = ARCHIVE_BLOCK_READINGS;
+
+			if (num_blocks == max_blocks) {
+				max_blocks = max_blocks ? 2 * max_blocks : 64;
+				blocks = xrealloc(blocks, max_blocks * sizeof(archive_block_t));
+			}
+
+			archive_block_t *block = &blocks[num_blocks++];
+			size_t len = encode_block(m->readings + j, count, block, buf);
+			block->meter = i;
+			block->offset = offset;
+
+			if (len != fwrite(buf, 1, len, f))
+				goto handle_error;
+			offset += len;
+		}
+	}
+
+	uint64_t meters_offset = offset;
+	for (unsigned int i=0; i<w->num_meters; i++) {
+		size_t len = strlen(w->meters[i].serial);
+		if (EOF == putc(len, f) || len != fwrite(w->meters[i].serial, 1, len, f))
+			goto handle_error;
+		offset += 1 + len;
+	}
+
+	uint64_t directory_offset = offset;
+	for (unsigned int i=0; i<num_blocks; i++) {
+		const archive_block_t *block = &blocks[i];
+
+		put_u16(entry, block->meter);
+		entry[2] = block->width;
+		entry[3] = 0;
+		put_u32(entry + 4, block->count);
+		put_u32(entry + 8, block->min_date);
+		put_u32(entry + 12, block->max_date);
+		put_u32(entry + 16, block->min_reading);
+		put_u32(entry + 20, block->max_reading);
+		put_u64(entry + 24, block->offset);
+		put_u32(entry + 32, block->date_len);
+		if (1 != fwrite(entry, sizeof(entry), 1, f))
+			goto handle_error;
+	}
+
+	unsigned char trailer[TRAILER_LEN];
+	put_u64(trailer, meters_offset);
+	put_u64(trailer + 8, directory_offset);
+	put_u32(trailer + 16, w->num_meters);
+	put_u32(trailer + 20, num_blocks);
+	if (1 != fwrite(trailer, sizeof(trailer), 1, f))
+		goto handle_error;
+
+	// the data must reach the disk before the rename does
+	if (0 != fflush(f) || 0 != fsync(fileno(f)))
+		goto handle_error;
+
+	FILE *closing = f;
+	f = NULL;
+	if (0 != fclose(closing))
+		goto handle_error;
+
+	if (0 != rename(tmp, w->pathname) || 0 != sync_directory(w->pathname))
+		goto handle_error;
+
+	free(tmp);
+	free(blocks);
+	free(buf);
+	free_writer(w);
+	return 0;
+
+    handle_error:
+	error = errno;
+	ERROR("Cannot write archive %s (%s)\n", w->pathname, strerror(error));
+	if (f)
+		fclose(f);
+	(void) unlink(tmp);
+	free(tmp);
+	free(blocks);
+	free(buf);
+	free_writer(w);
+	errno = error;
+	return -1;
+}
+
+/**
+ * Discard an archive that is being created.
+ */
+void ultraeasy_archive_abandon(ultraeasy_archive_writer_t *w)
+{
+	free_writer(w);
+}
+
+/**
+ * Open an archive for reading.
+ *
+ * The archive is memory mapped. Only the meter table and the directory are
+ * read up front; blocks are decoded on demand.
+ */
+ultraeasy_archive_t *ultraeasy_archive_open(const char *pathname)
+{
+	struct stat st;
+	int error = EINVAL;
+
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (0 != fstat(fd, &st)) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+
+	if (st.st_size < sizeof(header) + TRAILER_LEN) {
+		ERROR("%s is not an archive\n", pathname);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	error = errno;
+	close(fd);
+	if (MAP_FAILED == map) {
+		errno = error;
+		return NULL;
+	}
+
+	ultraeasy_archive_t *archive = xzalloc(sizeof(ultraeasy_archive_t));
+	archive->map = map;
+	archive->size = st.st_size;
+
+	const unsigned char *p = archive->map;
+	if (0 != memcmp(p, header, sizeof(header)))
+		goto handle_corrupt;
+
+	const unsigned char *trailer = p + archive->size - TRAILER_LEN;
+	uint64_t meters_offset = get_u64(trailer);
+	uint64_t directory_offset = get_u64(trailer + 8);
+	uint32_t num_meters = get_u32(trailer + 16);
+	uint32_t num_blocks = get_u32(trailer + 20);
+
+	uint64_t end = archive->size - TRAILER_LEN;
+	if (meters_offset < sizeof(header) || meters_offset > directory_offset ||
+	    directory_offset > end || num_meters > MAX_METERS ||
+	    (end - directory_offset) / DIRECTORY_ENTRY_LEN != num_blocks ||
+	    (end - directory_offset) % DIRECTORY_ENTRY_LEN)
+		goto handle_corrupt;
+
+	archive->meters = xzalloc((num_meters + 1) * sizeof(char *));
+	for (uint64_t offset = meters_offset; archive->num_meters < num_meters; ) {
+		if (offset >= directory_offset || p[offset] > directory_offset - offset - 1)
+			goto handle_corrupt;
+
+		unsigned int len = p[offset];
+		char *serial = xzalloc(len + 1);
+		memcpy(serial, p + offset + 1, len);
+		archive->meters[archive->num_meters++] = serial;
+		offset += 1 + len;
+	}
+
+	archive->blocks = xzalloc((num_blocks + 1) * sizeof(archive_block_t));
+	for (archive->num_blocks = 0; archive->num_blocks < num_blocks; archive->num_blocks++) {
+		const unsigned char *entry = p + directory_offset +
+					     archive->num_blocks * DIRECTORY_ENTRY_LEN;
+		archive_block_t *block = &archive->blocks[archive->num_blocks];
+
+		block->meter = get_u16(entry);
+		block->width = entry[2];
+		block->count = get_u32(entry + 4);
+		block->min_date = get_u32(entry + 8);
+		block->max_date = get_u32(entry + 12);
+		block->min_reading = get_u32(entry + 16);
+		block->max_reading = get_u32(entry + 20);
+		block->offset = get_u64(entry + 24);
+		block->date_len = get_u32(entry + 32);
+
+		uint64_t len = block->date_len + ((uint64_t) block->count * block->width + 7) / 8;
+		if (block->meter >= num_meters || block->width > 32 ||
+		    0 == block->count || block->count > ARCHIVE_BLOCK_READINGS ||
+		    block->offset < sizeof(header) || block->offset > meters_offset ||
+		    len > meters_offset - block->offset)
+			goto handle_corrupt;
+	}
+
+	// blocks must be in meter order (and then in date order)
+	archive->meter_start = xzalloc((num_meters + 1) * sizeof(unsigned int));
+	archive->meter_end = xzalloc((num_meters + 1) * sizeof(unsigned int));
+	for (unsigned int i=0; i<num_blocks; i++) {
+		const archive_block_t *block = &archive->blocks[i];
+
+		if (block->min_date > block->max_date)
+			goto handle_corrupt;
+
+		if (i && block->meter == archive->blocks[i - 1].meter) {
+			if (block->min_date < archive->blocks[i - 1].max_date)
+				goto handle_corrupt;
+		} else {
+			if (i && block->meter < archive->blocks[i - 1].meter)
+				goto handle_corrupt;
+			archive->meter_start[block->meter] = i;
+		}
+		archive->meter_end[block->meter] = i + 1;
+	}
+
+	return archive;
+
+    handle_corrupt:
+	ERROR("%s is not an archive (or is corrupt)\n", pathname);
+	ultraeasy_archive_close(archive);
+	errno = EINVAL;
+	return NULL;
+}
+
+/**
+ * Unpack a block's (bit-packed) reading column.
+ */
+static void unpack_readings(ultraeasy_archive_t *archive, const archive_block_t *block,
+			    uint32_t *readings)
+{
+	const unsigned char *p = archive->map + block->offset + block->date_len;
+	uint64_t acc = 0;
+	unsigned int bits = 0;
+	uint64_t mask = (1ull << block->width) - 1;
+
+	for (unsigned int i=0; i<block->count; i++) {
+		while (bits < block->width) {
+			acc |= (uint64_t) *p++ << bits;
+			bits += 8;
+		}
+		readings[i] = block->min_reading + (uint32_t) (acc & mask);
+		acc >>= block->width;
+		bits -= block->width;
+	}
+}
+
+/**
+ * Decode a block into an array of (at least block->count) records.
+ *
+ * Returns -1 (with errno set to EINVAL) if the block's dates run past the
+ * end of its date column.
+ */
+static int decode_block(ultraeasy_archive_t *archive, const archive_block_t *block,
+			ultraeasy_record_t *records)
+{
+	const unsigned char *p = archive->map + block->offset;
+	const unsigned char *end = p + block->date_len;
+	uint32_t readings[ARCHIVE_BLOCK_READINGS];
+	uint32_t date = block->min_date;
+
+	unpack_readings(archive, block, readings);
+
+	for (unsigned int i=0; i<block->count; i++) {
+		if (i) {
+			uint32_t delta = 0;
+			unsigned int shift = 0;
+			do {
+				if (p >= end || shift > 28) {
+					errno = EINVAL;
+					return -1;
+				}
+				delta |= (uint32_t) (*p & 0x7f) << shift;
+				shift += 7;
+			} while (*p++ & 0x80);
+			date += delta;
+		}
+
+		ultraeasy_record_from_raw(&records[i], date, readings[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * Count the readings in an archive.
+ */
+unsigned long ultraeasy_archive_count(ultraeasy_archive_t *archive)
+{
+	unsigned long count = 0;
+
+	for (unsigned int i=0; i<archive->num_blocks; i++)
+		count += archive->blocks[i].count;
+
+	return count;
+}
+
+/**
+ * Call fn for every reading in the archive (grouped by meter and then in
+ * date order).
+ *
+ * fn returns 0 to continue or non-zero to stop early. Returns -1 if the
+ * archive is corrupt.
+ */
+int ultraeasy_archive_foreach(ultraeasy_archive_t *archive, ultraeasy_store_fn_t fn, void *ctx)
+{
+	ultraeasy_record_t *records = xzalloc(ARCHIVE_BLOCK_READINGS * sizeof(ultraeasy_record_t));
+	int res = 0;
+
+	for (unsigned int i=0; i<archive->num_blocks; i++) {
+		const archive_block_t *block = &archive->blocks[i];
+
+		res = decode_block(archive, block, records);
+		if (0 != res)
+			break;
+
+		for (unsigned int j=0; j<block->count; j++)
+			if (0 != fn(ctx, archive->meters[block->meter], &records[j]))
+				goto out;
+	}
+
+    out:
+	free(records);
+	return res;
+}
+
+/**
+ * Find the blocks that may hold readings from a meter in a time range.
+ *
+ * Sets *first and *last to the range of blocks (which is empty if the
+ * meter has no readings in the range).
+ */
+static void select_blocks(ultraeasy_archive_t *archive, unsigned int meter,
+			  uint32_t from, uint32_t to, unsigned int *first, unsigned int *last)
+{
+	unsigned int lo = archive->meter_start[meter];
+	unsigned int hi = archive->meter_end[meter];
+
+	// the first block that ends at or after the start of the range
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (archive->blocks[mid].max_date < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*first = lo;
+
+	// and the first block that starts after the end of the range
+	hi = archive->meter_end[meter];
+	while (lo < hi && archive->blocks[lo].min_date <= to)
+		lo++;
+	*last = lo;
+}
+
+/**
+ * Convert a time range into raw dates (clamping it to what they can hold).
+ */
+static bool raw_range(time_t from, time_t to, uint32_t *raw_from, uint32_t *raw_to)
+{
+	if (from > to || to < 0 || from > UINT32_MAX)
+		return false;
+
+	*raw_from = from < 0 ? 0 : from;
+	*raw_to = to > UINT32_MAX ? UINT32_MAX : to;
+	return true;
+}
+
+/**
+ * Look up a meter by serial number.
+ *
+ * Returns -1 if the archive holds no readings from the meter.
+ */
+static int find_archived_meter(ultraeasy_archive_t *archive, const char *serial)
+{
+	for (unsigned int i=0; i<archive->num_meters; i++)
+		if (0 == strcmp(archive->meters[i], serial))
+			return i;
+
+	return -1;
+}
+
+/**
+ * Call fn for every reading from a meter (or from every meter if serial is
+ * NULL) taken between from and to (inclusive).
+ *
+ * Only the blocks that overlap the range are decoded. Readings are
+ * reported as for ultraeasy_archive_foreach().
+ */
+int ultraeasy_archive_query(ultraeasy_archive_t *archive, const char *serial,
+			    time_t from, time_t to, ultraeasy_store_fn_t fn, void *ctx)
+{
+	uint32_t raw_from, raw_to;
+	int res = 0;
+
+	if (!raw_range(from, to, &raw_from, &raw_to))
+		return 0;
+
+	int meter = serial ? find_archived_meter(archive, serial) : 0;
+	if (meter < 0)
+		return 0;
+
+	ultraeasy_record_t *records = xzalloc(ARCHIVE_BLOCK_READINGS * sizeof(ultraeasy_record_t));
+
+	for (unsigned int m = meter; m < (serial ? meter + 1 : archive->num_meters); m++) {
+		unsigned int first, last;
+		select_blocks(archive, m, raw_from, raw_to, &first, &last);
+
+		for (unsigned int i=first; i<last; i++) {
+			const archive_block_t *block = &archive->blocks[i];
+
+			res = decode_block(archive, block, records);
+			if (0 != res)
+				goto out;
+
+			for (unsigned int j=0; j<block->count; j++) {
+				if (records[j].raw.date < raw_from || records[j].raw.date > raw_to)
+					continue;
+				if (0 != fn(ctx, archive->meters[m], &records[j]))
+					goto out;
+			}
+		}
+	}
+
+    out:
+	free(records);
+	return res;
+}
+
+/**
+ * Summarise the readings from a meter (or from every meter if serial is
+ * NULL) taken between from and to (inclusive).
+ *
+ * Blocks that lie entirely within the range are summarised from their
+ * directory entries plus their reading column; only the blocks at the ends
+ * of the range have to be decoded in full.
+ */
+int ultraeasy_archive_summarise(ultraeasy_archive_t *archive, const char *serial,
+				time_t from, time_t to, ultraeasy_summary_t *summary)
+{
+	uint32_t readings[ARCHIVE_BLOCK_READINGS];
+	uint32_t raw_from, raw_to;
+	ultraeasy_record_t *records = NULL;
+	int res = 0;
+
+	memset(summary, 0, sizeof(*summary));
+
+	if (!raw_range(from, to, &raw_from, &raw_to))
+		return 0;
+
+	int meter = serial ? find_archived_meter(archive, serial) : 0;
+	if (meter < 0)
+		return 0;
+
+	for (unsigned int m = meter; m < (serial ? meter + 1 : archive->num_meters); m++) {
+		unsigned int first, last;
+		select_blocks(archive, m, raw_from, raw_to, &first, &last);
+		summary->blocks_skipped += (archive->meter_end[m] - archive->meter_start[m]) -
+					   (last - first);
+
+		for (unsigned int i=first; i<last; i++) {
+			const archive_block_t *block = &archive->blocks[i];
+			summary->blocks_read++;
+
+			if (block->min_date >= raw_from && block->max_date <= raw_to) {
+				if (0 == summary->count || block->min_reading < summary->min_reading)
+					summary->min_reading = block->min_reading;
+				if (0 == summary->count || block->max_reading > summary->max_reading)
+					summary->max_reading = block->max_reading;
+				summary->count += block->count;
+
+				unpack_readings(archive, block, readings);
+				for (unsigned int j=0; j<block->count; j++)
+					summary->sum += readings[j];
+				continue;
+			}
+
+			if (!records)
+				records = xzalloc(ARCHIVE_BLOCK_READINGS * sizeof(ultraeasy_record_t));
+			res = decode_block(archive, block, records);
+			if (0 != res)
+				goto out;
+
+			for (unsigned int j=0; j<block->count; j++) {
+				const ultraeasy_record_t *r = &records[j];
+				if (r->raw.date < raw_from || r->raw.date > raw_to)
+					continue;
+
+				if (0 == summary->count || r->raw.reading < summary->min_reading)
+					summary->min_reading = r->raw.reading;
+				if (0 == summary->count || r->raw.reading > summary->max_reading)
+					summary->max_reading = r->raw.reading;
+				summary->count++;
+				summary->sum += r->raw.reading;
+			}
+		}
+	}
+
+    out:
+	free(records);
+	return res;
+}
+
+void ultraeasy_archive_close(ultraeasy_archive_t *archive)
+{
+	for (unsigned int i=0; i<archive->num_meters; i++)
+		free(archive->meters[i]);
+	free(archive->meters);
+	free(archive->blocks);
+	free(archive->meter_start);
+	free(archive->meter_end);
+	munmap((void *) archive->map, archive->size);
+	free(archive);
+}
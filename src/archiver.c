@@ -0,0 +1,250 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading archive tool.
+ *
+ * Converts a reading store (see ultraeasy --sync-db) or a legacy ASCII
+ * database (see ue-dbupdate) into a reading archive and shows the contents
+ * of archives.
+ *
+ * Usage: ue-archive [OPTION]... ARCHIVE
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "show.h"
+#include "ultraeasy.h"
+#include "util.h"
+
+/* state for archive_reading() */
+typedef struct convert {
+	ultraeasy_archive_writer_t *writer;
+	int error;
+} convert_t;
+
+static int archive_reading(void *ctx, const char *serial, const ultraeasy_record_t *record)
+{
+	convert_t *convert = ctx;
+
+	if (0 != ultraeasy_archive_write(convert->writer, serial, record)) {
+		convert->error = errno;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Create an archive holding every reading in a store.
+ */
+static int create_archive(const char *pathname, const char *store_path)
+{
+	ultraeasy_store_t *store = ultraeasy_store_open(store_path);
+	if (NULL == store) {
+		fprintf(stderr, "Cannot open reading store %s: %s\n", store_path, strerror(errno));
+		return -1;
+	}
+
+	convert_t convert = { .writer = ultraeasy_archive_create(pathname) };
+	(void) ultraeasy_store_foreach(store, archive_reading, &convert);
+	(void) ultraeasy_store_close(store);
+	if (0 != convert.error) {
+		fprintf(stderr, "Cannot archive readings: %s\n", strerror(convert.error));
+		ultraeasy_archive_abandon(convert.writer);
+		return -1;
+	}
+
+	if (0 != ultraeasy_archive_finish(convert.writer)) {
+		fprintf(stderr, "Cannot write archive %s: %s\n", pathname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Create an archive holding every reading in an ASCII database.
+ *
+ * These files do not record the meter's serial number so it must be
+ * supplied.
+ */
+static int create_archive_from_adb(const char *pathname, const char *adb,
+				   const char *serial)
+{
+	unsigned long num_records;
+	ultraeasy_record_t *records = ultraeasy_load_adb(adb, 0, &num_records);
+	if (NULL == records) {
+		fprintf(stderr, "Cannot load ASCII database %s: %s\n", adb, strerror(errno));
+		return -1;
+	}
+
+	convert_t convert = { .writer = ultraeasy_archive_create(pathname) };
+	for (unsigned long i=0; i<num_records; i++)
+		if (0 != archive_reading(&convert, serial, &records[i]))
+			break;
+	free(records);
+	if (0 != convert.error) {
+		fprintf(stderr, "Cannot archive readings: %s\n", strerror(convert.error));
+		ultraeasy_archive_abandon(convert.writer);
+		return -1;
+	}
+
+	if (0 != ultraeasy_archive_finish(convert.writer)) {
+		fprintf(stderr, "Cannot write archive %s: %s\n", pathname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+const char usage_text[] = "Usage: ue-archive [OPTION]... ARCHIVE\n";
+
+static void show_help()
+{
+	printf(usage_text);
+
+	printf(
+"Create and examine reading archives.\n"
+"\n"
+"  -a, --adb=FILE             create ARCHIVE from the ASCII database FILE\n"
+"                             (see ue-dbupdate, requires --meter)\n"
+"  -d, --dump                 show the readings in plain text\n"
+"  -h, --help                 show this help text and exit\n"
+"  -m, --meter=SERIAL         serial number of the meter whose readings are\n"
+"                             in the ASCII database\n"
+"  -R, --raw                  show the raw readings in hex format\n"
+"  -S, --sheet                show the readings as a spreadsheet with a row\n"
+"                             per day and a column per hour\n"
+"  -s, --store=FILE           create ARCHIVE from the reading store FILE\n"
+"                             (see ultraeasy --sync-db)\n"
+"  -V, --verbose              increase the level of internal logging\n"
+"\n"
+"Readings are shown grouped by meter and then in date order.\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	show_t show = { .tagged = true };
+	const char *store = NULL;
+	const char *adb = NULL;
+	const char *meter = NULL;
+	int c;
+
+	static struct option long_options[] = {
+		{ "adb", 1, 0, 'a' },
+		{ "dump", 0, 0, 'd' },
+		{ "help", 0, 0, 'h' },
+		{ "meter", 1, 0, 'm' },
+		{ "raw", 0, 0, 'R' },
+		{ "sheet", 0, 0, 'S' },
+		{ "store", 1, 0, 's' },
+		{ "verbose", 0, 0, 'V' },
+		{0, 0, 0,  0 }
+	};
+
+	while (-1 != (c = getopt_long(argc, argv, "a:dhm:RSs:V", long_options, NULL))) {
+		switch (c) {
+		case 'a': // --adb
+			adb = optarg;
+			break;
+		case 'd': // --dump
+			show.fn = show_reading;
+			show.want_sheet = false;
+			break;
+		case 'h': // --help
+			show_help();
+			return 0;
+		case 'm': // --meter
+			meter = optarg;
+			break;
+		case 'R': // --raw
+			show.fn = show_raw_reading;
+			show.want_sheet = false;
+			break;
+		case 'S': // --sheet
+			show.fn = show_reading;
+			show.want_sheet = true;
+			break;
+		case 's': // --store
+			store = optarg;
+			break;
+		case 'V': // --verbose
+			trace_level++;
+			break;
+		default:
+			fprintf(stderr, usage_text);
+			fprintf(stderr, "Try '--help'.\n");
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, usage_text);
+		fprintf(stderr, "Try '--help'.\n");
+		return 1;
+	}
+	const char *pathname = argv[optind];
+
+	if (!store && !adb && !show.fn) {
+		fprintf(stderr, "No action requested\nTry '--help'\n");
+		return 2;
+	}
+
+	if (store && adb) {
+		fprintf(stderr, "Cannot use --store and --adb together\n");
+		return 2;
+	}
+
+	if (adb && !meter) {
+		fprintf(stderr, "No meter serial number given for %s (use --meter)\n", adb);
+		return 2;
+	}
+
+	if (store && 0 != create_archive(pathname, store))
+		return 1;
+
+	if (adb && 0 != create_archive_from_adb(pathname, adb, meter))
+		return 1;
+
+	if (show.fn) {
+		ultraeasy_archive_t *archive = ultraeasy_archive_open(pathname);
+		if (NULL == archive) {
+			fprintf(stderr, "Cannot open archive %s: %s\n", pathname, strerror(errno));
+			return 1;
+		}
+
+		int res = ultraeasy_archive_foreach(archive, show_meter_reading, &show);
+		if (0 == res)
+			show_end(&show);
+		ultraeasy_archive_close(archive);
+		if (0 != res) {
+			fprintf(stderr, "Cannot read archive %s: %s\n", pathname, strerror(errno));
+			return 1;
+		}
+	}
+
+	return 0;
+}
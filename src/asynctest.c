@@ -0,0 +1,113 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Download every record from a meter using the non-blocking interface
+ * (driven from a poll() loop) and show them in the same format as
+ * ultraeasy --dump. A record that cannot be fetched is reported and the
+ * download moves on to the next one. The link statistics are shown at the
+ * end so that the retry policy can be compared with the blocking interface
+ * (--blocking).
+ *
+ * Usage: asynctest [--blocking] DEVICE
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ultraeasy.h"
+
+static void show_reading(const ultraeasy_record_t *reading)
+{
+	struct tm exploded;
+	gmtime_r(&reading->date, &exploded);
+
+	printf("%4d-%02d-%02d %02d:%02d:%02d    %4.1f mmol/l\n",
+			exploded.tm_year + 1900, exploded.tm_mon+1, exploded.tm_mday,
+			exploded.tm_hour, exploded.tm_min, exploded.tm_sec,
+			reading->mmol_per_litre);
+}
+
+static int get_record(ultraeasy_t *meter, unsigned int num, ultraeasy_record_t *record)
+{
+	int res = ultraeasy_start_get_record(meter, num);
+	if (0 != res)
+		return res;
+
+	while (1 == (res = ultraeasy_continue_get_record(meter, record))) {
+		struct pollfd pollee = {
+			.fd = ultraeasy_get_fd(meter),
+			.events = ultraeasy_get_events(meter),
+		};
+
+		if (poll(&pollee, 1, ultraeasy_get_timeout(meter)) < 0 && EINTR != errno)
+			return -1;
+	}
+
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	bool blocking = false;
+	int failures = 0;
+
+	if (argc == 3 && 0 == strcmp(argv[1], "--blocking"))
+		blocking = true;
+	else if (argc != 2) {
+		fprintf(stderr, "Usage: asynctest [--blocking] DEVICE\n");
+		return 2;
+	}
+
+	ultraeasy_t *meter = ultraeasy_open(argv[argc - 1]);
+	if (!meter) {
+		fprintf(stderr, "Cannot open meter: %s\n", strerror(errno));
+		return 1;
+	}
+
+	int num_records = ultraeasy_num_records(meter);
+	if (num_records < 0) {
+		fprintf(stderr, "Cannot read number of records: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for (int i=0; i<num_records; i++) {
+		ultraeasy_record_t record;
+		int res = blocking ? ultraeasy_get_record(meter, i, &record)
+				   : get_record(meter, i, &record);
+		if (0 != res) {
+			fprintf(stderr, "Cannot read record %d: %s\n", i, strerror(errno));
+			failures++;
+			continue;
+		}
+
+		show_reading(&record);
+	}
+
+	ultraeasy_stats_t stats;
+	ultraeasy_get_stats(meter, &stats);
+	printf("resets %llu retries %llu\n",
+			(unsigned long long) stats.resets, (unsigned long long) stats.retries);
+
+	ultraeasy_close(meter);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,462 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * End-to-end benchmark.
+ *
+ * Runs a set of standard scenarios against meters simulated by ue-sim
+ * (so the real serial code path is measured) and reports one JSON object
+ * per scenario. Results can be checked against (or saved as) a baseline.
+ *
+ * Usage: uebench [--sim=PATH] [--baseline=FILE [--update-baseline]]
+ *                [--tolerance=PERCENT] [SCENARIO]...
+ */
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ultraeasy.h"
+#include "util.h"
+
+typedef struct {
+	const char *name;
+	unsigned int meters;
+	unsigned int records;
+	const char *sim_options;
+} scenario_t;
+
+/* the turnaround is short so the benchmark measures our code, not the meter */
+#define QUIET "--turnaround=2"
+#define NOISY "--turnaround=2 --latency=1000 --jitter=200 --junk=10 --drop=2 --corrupt=2 --seed=1"
+
+static const scenario_t scenarios[] = {
+	{ "empty", 1, 0, QUIET },
+	{ "three", 1, 3, QUIET },
+	{ "full", 1, 500, QUIET },
+	{ "noisy", 1, 50, NOISY },
+	{ "parallel", 8, 20, QUIET },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+#define MAX_METERS 8
+
+/* the metrics that are checked against the baseline (and how much slack each has) */
+typedef struct {
+	double setup_ms;
+	double p50_ms;
+	double p90_ms;
+	double p99_ms;
+	double max_ms;
+	double retries;
+	double syscr;
+	double syscw;
+	double peak_rss_kb;
+} results_t;
+
+static const struct {
+	const char *name;
+	size_t offset;
+	double slack;
+} metrics[] = {
+	{ "setup_ms", offsetof(results_t, setup_ms), 5 },
+	{ "p50_ms", offsetof(results_t, p50_ms), 5 },
+	{ "p90_ms", offsetof(results_t, p90_ms), 5 },
+	{ "p99_ms", offsetof(results_t, p99_ms), 10 },
+	{ "max_ms", offsetof(results_t, max_ms), 50 },
+	{ "retries", offsetof(results_t, retries), 2 },
+	{ "syscr", offsetof(results_t, syscr), 50 },
+	{ "syscw", offsetof(results_t, syscw), 50 },
+	{ "peak_rss_kb", offsetof(results_t, peak_rss_kb), 1024 },
+};
+
+#define NUM_METRICS (sizeof(metrics) / sizeof(metrics[0]))
+#define METRIC(r, i) (*(double *) ((char *) (r) + metrics[i].offset))
+
+typedef struct {
+	const char *device;
+	unsigned int records;
+
+	// results
+	bool ok;
+	double setup_ms;
+	unsigned int retries;
+	double *latencies;
+	unsigned int num_latencies;
+} session_t;
+
+static const char *sim_path = "./ue-sim";
+
+/**
+ * Start a meter simulator and return its pid (the pseudo-terminal it is
+ * using is written to pts).
+ */
+static pid_t start_sim(const scenario_t *s, char *pts, size_t len)
+{
+	int fds[2];
+
+	if (0 != pipe(fds))
+		return -1;
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (0 == pid) {
+		char *records = xstrdup_printf("--records=%u", s->records);
+		char *cmd = xstrdup_printf("exec %s %s %s", sim_path, records, s->sim_options);
+
+		dup2(fds[1], 1);
+		close(fds[0]);
+		execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	FILE *f = fdopen(fds[0], "r");
+	if (!f || !fgets(pts, len, f)) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		if (f)
+			fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	pts[strcspn(pts, "\n")] = '\0';
+	return pid;
+}
+
+static void stop_sim(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static double elapsed_ms(uint64_t start)
+{
+	return (us_gettime(CLOCK_MONOTONIC) - start) / 1000.0;
+}
+
+/**
+ * Connect to a meter and download every record, timing each step.
+ */
+static void *run_session(void *arg)
+{
+	session_t *session = arg;
+	uint64_t start = us_gettime(CLOCK_MONOTONIC);
+
+	ultraeasy_t *meter = ultraeasy_open(session->device);
+	if (!meter)
+		return NULL;
+	ultraeasy_set_adaptive_guard(meter, true);
+	session->setup_ms = elapsed_ms(start);
+
+	int num_records = ultraeasy_num_records(meter);
+	if (num_records < 0 || num_records != session->records)
+		goto out;
+
+	session->latencies = xzalloc((num_records + 1) * sizeof(double));
+	for (int i=0; i<num_records; i++) {
+		ultraeasy_record_t record;
+
+		start = us_gettime(CLOCK_MONOTONIC);
+		if (0 != ultraeasy_get_record(meter, i, &record))
+			goto out;
+		session->latencies[session->num_latencies++] = elapsed_ms(start);
+	}
+
+	session->ok = true;
+
+    out:
+	{
+		ultraeasy_stats_t stats;
+		ultraeasy_get_stats(meter, &stats);
+		session->retries = stats.retries;
+	}
+
+	ultraeasy_close(meter);
+	return NULL;
+}
+
+/**
+ * Read the number of read and write system calls we have made.
+ */
+static void read_syscalls(double *syscr, double *syscw)
+{
+	char line[128];
+	unsigned long long value;
+
+	*syscr = *syscw = 0;
+
+	FILE *f = fopen("/proc/self/io", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (1 == sscanf(line, "syscr: %llu", &value))
+			*syscr = value;
+		else if (1 == sscanf(line, "syscw: %llu", &value))
+			*syscw = value;
+	}
+
+	fclose(f);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned int num, unsigned int pct)
+{
+	if (0 == num)
+		return 0;
+
+	unsigned int i = (pct * num + 99) / 100;
+	return sorted[i ? i - 1 : 0];
+}
+
+static bool run_scenario(const scenario_t *s, results_t *results)
+{
+	pid_t sims[MAX_METERS];
+	char pts[MAX_METERS][64];
+	session_t sessions[MAX_METERS];
+	pthread_t threads[MAX_METERS];
+	double syscr, syscw;
+	bool ok = true;
+
+	memset(results, 0, sizeof(*results));
+	memset(sessions, 0, sizeof(sessions));
+
+	for (unsigned int i=0; i<s->meters; i++) {
+		sims[i] = start_sim(s, pts[i], sizeof(pts[i]));
+		if (sims[i] < 0) {
+			fprintf(stderr, "%s: cannot start %s\n", s->name, sim_path);
+			while (i--)
+				stop_sim(sims[i]);
+			return false;
+		}
+
+		sessions[i].device = pts[i];
+		sessions[i].records = s->records;
+	}
+
+	read_syscalls(&syscr, &syscw);
+
+	for (unsigned int i=0; i<s->meters; i++)
+		pthread_create(&threads[i], NULL, run_session, &sessions[i]);
+
+	unsigned int num_latencies = 0;
+	double *latencies = xzalloc((s->meters * s->records + 1) * sizeof(double));
+
+	for (unsigned int i=0; i<s->meters; i++) {
+		pthread_join(threads[i], NULL);
+		stop_sim(sims[i]);
+
+		if (!sessions[i].ok) {
+			fprintf(stderr, "%s: download from meter %u failed\n", s->name, i);
+			ok = false;
+		}
+
+		results->setup_ms += sessions[i].setup_ms / s->meters;
+		memcpy(latencies + num_latencies, sessions[i].latencies,
+		       sessions[i].num_latencies * sizeof(double));
+		num_latencies += sessions[i].num_latencies;
+		free(sessions[i].latencies);
+
+		results->retries += sessions[i].retries;
+	}
+
+	double syscr_now, syscw_now;
+	read_syscalls(&syscr_now, &syscw_now);
+	results->syscr = syscr_now - syscr;
+	results->syscw = syscw_now - syscw;
+
+	qsort(latencies, num_latencies, sizeof(double), compare_double);
+	results->p50_ms = percentile(latencies, num_latencies, 50);
+	results->p90_ms = percentile(latencies, num_latencies, 90);
+	results->p99_ms = percentile(latencies, num_latencies, 99);
+	results->max_ms = num_latencies ? latencies[num_latencies - 1] : 0;
+	free(latencies);
+
+	struct rusage usage;
+	if (0 == getrusage(RUSAGE_SELF, &usage))
+		results->peak_rss_kb = usage.ru_maxrss;
+
+	return ok;
+}
+
+static void show_results(const scenario_t *s, const results_t *results)
+{
+	printf("{\"scenario\": \"%s\", \"meters\": %u, \"records\": %u",
+	       s->name, s->meters, s->records);
+	for (unsigned int i=0; i<NUM_METRICS; i++)
+		printf(", \"%s\": %.3f", metrics[i].name, METRIC(results, i));
+	printf("}\n");
+	fflush(stdout);
+}
+
+/**
+ * Look up a value in the baseline (lines of "scenario metric value").
+ */
+static bool lookup_baseline(const char *baseline, const char *scenario, const char *metric, double *value)
+{
+	char line[256], s[64], m[64];
+	bool found = false;
+
+	FILE *f = fopen(baseline, "r");
+	if (!f)
+		return false;
+
+	while (!found && fgets(line, sizeof(line), f))
+		if ('#' != line[0] && 3 == sscanf(line, "%63s %63s %lf", s, m, value))
+			found = (0 == strcmp(s, scenario) && 0 == strcmp(m, metric));
+
+	fclose(f);
+	return found;
+}
+
+static bool check_baseline(const char *baseline, double tolerance,
+			   const scenario_t *s, const results_t *results)
+{
+	bool ok = true;
+
+	for (unsigned int i=0; i<NUM_METRICS; i++) {
+		double expected;
+		if (!lookup_baseline(baseline, s->name, metrics[i].name, &expected))
+			continue;
+
+		double limit = expected * (1 + tolerance / 100) + metrics[i].slack;
+		if (METRIC(results, i) > limit) {
+			fprintf(stderr, "%s: %s regressed to %.3f (baseline %.3f, limit %.3f)\n",
+				s->name, metrics[i].name, METRIC(results, i), expected, limit);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static void save_baseline(FILE *f, const scenario_t *s, const results_t *results)
+{
+	for (unsigned int i=0; i<NUM_METRICS; i++)
+		fprintf(f, "%s %s %.3f\n", s->name, metrics[i].name, METRIC(results, i));
+}
+
+static void show_usage(void)
+{
+	fprintf(stderr, "Usage: uebench [--sim=PATH] [--baseline=FILE [--update-baseline]]\n"
+			"               [--tolerance=PERCENT] [SCENARIO]...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *baseline = NULL;
+	bool update_baseline = false;
+	double tolerance = 25;
+	FILE *new_baseline = NULL;
+	bool ok = true;
+	int c;
+
+	static struct option long_options[] = {
+		{ "baseline", 1, 0, 'b' },
+		{ "sim", 1, 0, 's' },
+		{ "tolerance", 1, 0, 't' },
+		{ "update-baseline", 0, 0, 'u' },
+		{0, 0, 0,  0 }
+	};
+
+	while (-1 != (c = getopt_long(argc, argv, "b:s:t:u", long_options, NULL))) {
+		switch (c) {
+		case 'b': // --baseline
+			baseline = optarg;
+			break;
+		case 's': // --sim
+			sim_path = optarg;
+			break;
+		case 't': // --tolerance
+			tolerance = strtod(optarg, NULL);
+			break;
+		case 'u': // --update-baseline
+			update_baseline = true;
+			break;
+		default:
+			show_usage();
+			return 1;
+		}
+	}
+
+	if (update_baseline) {
+		if (!baseline) {
+			show_usage();
+			return 1;
+		}
+
+		new_baseline = fopen(baseline, "w");
+		if (!new_baseline) {
+			fprintf(stderr, "Cannot write %s: %s\n", baseline, strerror(errno));
+			return 1;
+		}
+		fprintf(new_baseline, "# uebench baseline (scenario metric value)\n");
+	}
+
+	for (unsigned int i=0; i<NUM_SCENARIOS; i++) {
+		const scenario_t *s = &scenarios[i];
+		results_t results;
+
+		if (optind < argc) {
+			bool wanted = false;
+			for (int j=optind; j<argc; j++)
+				wanted = wanted || 0 == strcmp(argv[j], s->name);
+			if (!wanted)
+				continue;
+		}
+
+		if (!run_scenario(s, &results)) {
+			ok = false;
+			continue;
+		}
+
+		show_results(s, &results);
+
+		if (new_baseline)
+			save_baseline(new_baseline, s, &results);
+		else if (baseline && !check_baseline(baseline, tolerance, s, &results))
+			ok = false;
+	}
+
+	if (new_baseline)
+		fclose(new_baseline);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "util.h"
+
+static const unsigned char header[8] = { 'U', 'E', 'C', 'A', 'P', 0, CAPTURE_VERSION, 0 };
+
+struct capture {
+	FILE *f;
+	bool failed;
+};
+
+/**
+ * Create a capture file (replacing any existing file).
+ */
+capture_t *capture_create(const char *pathname)
+{
+	FILE *f = fopen(pathname, "wb");
+	if (!f)
+		return NULL;
+
+	if (1 != fwrite(header, sizeof(header), 1, f)) {
+		fclose(f);
+		return NULL;
+	}
+
+	capture_t *capture = xzalloc(sizeof(capture_t));
+	capture->f = f;
+	return capture;
+}
+
+/**
+ * Append a frame to the capture file.
+ *
+ * Writes are buffered by stdio so this does not cost a system call per frame.
+ * Errors are remembered and reported by capture_close().
+ */
+void capture_frame(capture_t *capture, capture_dir_t dir, const unsigned char *p, unsigned int len)
+{
+	uint64_t timestamp = us_gettime(CLOCK_MONOTONIC);
+	unsigned char record[10];
+
+	if (len > 255)
+		len = 255;
+
+	put_u64(record, timestamp);
+	record[8] = dir;
+	record[9] = len;
+
+	if (1 != fwrite(record, sizeof(record), 1, capture->f) ||
+	    len != fwrite(p, 1, len, capture->f))
+		capture->failed = true;
+}
+
+/**
+ * Close the capture file.
+ *
+ * Returns -1 if any of the data could not be written.
+ */
+int capture_close(capture_t *capture)
+{
+	bool failed = capture->failed;
+
+	if (0 != fclose(capture->f))
+		failed = true;
+	free(capture);
+
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Read an entire capture file into memory.
+ *
+ * Returns a malloc'ed array of records (or NULL with errno set on error).
+ */
+capture_record_t *capture_load(const char *pathname, unsigned int *num_records)
+{
+	unsigned char buf[10];
+	capture_record_t *records = NULL;
+	unsigned int num = 0, max = 0;
+
+	FILE *f = fopen(pathname, "rb");
+	if (!f)
+		return NULL;
+
+	if (1 != fread(buf, 8, 1, f) || 0 != memcmp(buf, header, sizeof(header))) {
+		ERROR("%s is not a capture file\n", pathname);
+		goto handle_error;
+	}
+
+	while (1 == fread(buf, sizeof(buf), 1, f)) {
+		if (num == max) {
+			max = max ? 2 * max : 64;
+			records = xrealloc(records, max * sizeof(capture_record_t));
+		}
+
+		capture_record_t *r = &records[num];
+		r->timestamp = get_u64(buf);
+		r->dir = buf[8];
+		r->len = buf[9];
+
+		if (r->dir > CAPTURE_RX || r->len != fread(r->data, 1, r->len, f)) {
+			ERROR("%s is corrupt\n", pathname);
+			goto handle_error;
+		}
+
+		num++;
+	}
+
+	if (!records)
+		records = xzalloc(sizeof(capture_record_t));
+
+	fclose(f);
+	*num_records = num;
+	return records;
+
+    handle_error:
+	free(records);
+	fclose(f);
+	errno = EINVAL;
+	return NULL;
+}
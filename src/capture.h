@@ -0,0 +1,59 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Capture files record every frame that crosses the link.
+ *
+ * The file starts with an 8 byte header ("UECAP", a NUL, the format version
+ * and another NUL) followed by one record per frame:
+ *
+ *   timestamp (8 bytes, CLOCK_MONOTONIC in microseconds, little endian)
+ *   direction (1 byte, CAPTURE_TX or CAPTURE_RX)
+ *   length    (1 byte)
+ *   frame     (length bytes)
+ */
+
+#define CAPTURE_VERSION 1
+
+typedef enum capture_dir {
+	CAPTURE_TX,
+	CAPTURE_RX,
+} capture_dir_t;
+
+typedef struct capture_record {
+	uint64_t timestamp;
+	capture_dir_t dir;
+	unsigned int len;
+	unsigned char data[256];
+} capture_record_t;
+
+typedef struct capture capture_t;
+
+capture_t *capture_create(const char *pathname);
+void capture_frame(capture_t *capture, capture_dir_t dir, const unsigned char *p, unsigned int len);
+int capture_close(capture_t *capture);
+
+capture_record_t *capture_load(const char *pathname, unsigned int *num_records);
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,34 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDS_H_
+#define COMMANDS_H_
+
+#include "ue_link.h"
+
+typedef enum command_id {
+#define COMMAND(name, ...) CMD_##name,
+#include "commands.def"
+#undef COMMAND
+	NUM_CMDS
+} command_id_t;
+
+/* generated from commands.def at build time (see gencmds.c) */
+extern const link_cmd_t command_frames[NUM_CMDS];
+
+#endif /* COMMANDS_H_ */
@@ -0,0 +1,33 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC_H_
+#define CRC_H_
+
+#include <stdint.h>
+
+#define CRC_CCITT_INITIAL 0xffff
+
+uint16_t crc_ccitt(uint16_t crc, const unsigned char *p, unsigned int len);
+
+uint16_t crc_ccitt_bitwise(uint16_t crc, const unsigned char *p, unsigned int len);
+uint16_t crc_ccitt_bytewise(uint16_t crc, const unsigned char *p, unsigned int len);
+uint16_t crc_ccitt_slice4(uint16_t crc, const unsigned char *p, unsigned int len);
+uint16_t crc_ccitt_slice8(uint16_t crc, const unsigned char *p, unsigned int len);
+
+#endif /* CRC_H_ */
@@ -0,0 +1,159 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark (and cross-check) for the CRC implementations.
+ *
+ * Usage: crcbench [--verify | --tables]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc.h"
+#include "util.h"
+
+typedef uint16_t (*crcfn_t)(uint16_t, const unsigned char *, unsigned int);
+
+static const struct {
+	const char *name;
+	crcfn_t fn;
+} implementations[] = {
+	{ "bitwise", crc_ccitt_bitwise },
+	{ "bytewise", crc_ccitt_bytewise },
+	{ "slice4", crc_ccitt_slice4 },
+	{ "slice8", crc_ccitt_slice8 },
+	{ "default", crc_ccitt },
+};
+
+#define NUM_IMPLEMENTATIONS (sizeof(implementations) / sizeof(implementations[0]))
+
+/* frame sized buffers (smallest and largest frames) and a bulk buffer */
+static const unsigned int lengths[] = { 6, 40, 4096 };
+
+#define NUM_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+#define BENCH_MS 200
+
+static unsigned char buffer[4096];
+
+/**
+ * Check every implementation against the bitwise reference.
+ */
+static bool verify(void)
+{
+	bool ok = true;
+
+	for (unsigned int len = 0; len <= 256; len++) {
+		for (unsigned int offset = 0; offset < 8; offset++) {
+			const unsigned char *p = buffer + offset;
+			uint16_t expected = crc_ccitt_bitwise(CRC_CCITT_INITIAL, p, len);
+
+			for (int i=1; i<NUM_IMPLEMENTATIONS; i++) {
+				uint16_t actual = implementations[i].fn(CRC_CCITT_INITIAL, p, len);
+				if (actual != expected) {
+					fprintf(stderr, "%s: %u bytes at offset %u gave 0x%04x (expected 0x%04x)\n",
+							implementations[i].name, len, offset, actual, expected);
+					ok = false;
+				}
+			}
+		}
+	}
+
+	return ok;
+}
+
+/**
+ * Print the lookup tables used by crc.c (calculated using the bitwise
+ * reference implementation).
+ */
+static void show_tables(void)
+{
+	uint16_t table[8][256];
+
+	for (int i=0; i<256; i++) {
+		unsigned char zeros[8] = { i };
+
+		for (int k=0; k<8; k++)
+			table[k][i] = crc_ccitt_bitwise(0, zeros, k + 1);
+	}
+
+	printf("static const uint16_t crc_table[8][256] = {\n");
+	for (int k=0; k<8; k++) {
+		printf("\t{\n");
+		for (int i=0; i<256; i++)
+			printf("%s0x%04x,%s", (i % 8) ? " " : "\t\t", table[k][i],
+					(i % 8) == 7 ? "\n" : "");
+		printf("\t},\n");
+	}
+	printf("};\n");
+}
+
+static void bench(const char *name, crcfn_t fn, unsigned int len)
+{
+	volatile uint16_t sink = 0;
+	unsigned long iterations = 0;
+	uint64_t start, elapsed;
+
+	start = ms_gettime(CLOCK_MONOTONIC);
+	do {
+		for (int i=0; i<1000; i++)
+			sink ^= fn(CRC_CCITT_INITIAL, buffer, len);
+		iterations += 1000;
+		elapsed = ms_gettime(CLOCK_MONOTONIC) - start;
+	} while (elapsed < BENCH_MS);
+
+	double bytes_per_sec = (iterations * (double) len * 1000.0) / elapsed;
+	printf("%-10s %5u bytes  %10.2f MB/s  %12.0f frames/s\n", name, len,
+			bytes_per_sec / 1000000.0, bytes_per_sec / len);
+	(void) sink;
+}
+
+int main(int argc, char *argv[])
+{
+	srand(1);
+	for (int i=0; i<sizeof(buffer); i++)
+		buffer[i] = rand();
+
+	if (argc > 1 && 0 == strcmp(argv[1], "--tables")) {
+		show_tables();
+		return 0;
+	}
+
+	if (!verify()) {
+		fprintf(stderr, "CRC implementations do not agree\n");
+		return 1;
+	}
+
+	if (argc > 1 && 0 == strcmp(argv[1], "--verify"))
+		return 0;
+
+	if (argc > 1) {
+		fprintf(stderr, "Usage: crcbench [--verify | --tables]\n");
+		return 1;
+	}
+
+	for (int l=0; l<NUM_LENGTHS; l++)
+		for (int i=0; i<NUM_IMPLEMENTATIONS; i++)
+			bench(implementations[i].name, implementations[i].fn, lengths[l]);
+
+	return 0;
+}
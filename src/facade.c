@@ -16,161 +16,371 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <assert.h>
+/*
+ * Simulated meter.
+ *
+ * The facade implements the meter's side of the link protocol (including
+ * the E and S sequence bits) and generates its replies, and their CRCs, on
+ * the fly. By default it holds the three records captured from a real
+ * meter but it can be configured to hold any number of (synthetic)
+ * records:
+ *
+ *   facade:records=500,wire
+ *
+ * Like a real meter the facade holds at most FACADE_MAX_RECORDS (500)
+ * records. "wire" delays each reply by the time the packets would have
+ * taken on the wire (see LINK_US_PER_BYTE).
+ */
+
 #include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "crc.h"
 #include "facade.h"
+#include "framer.h"
 #include "util.h"
 
+/* fixed replies, looked up by the message the PC sends */
 typedef struct {
-	unsigned char *p;
-	unsigned int len;
-} facade_atom_t;
+	const unsigned char *cmd;
+	unsigned int cmdlen;
+	const unsigned char *reply;
+	unsigned int replylen;
+} facade_entry_t;
 
-typedef struct {
-	facade_atom_t key;
-	facade_atom_t packets[3];
-} facade_data_t;
+#define ATOM(x) x, sizeof(x)
 
-static facade_atom_t *next_packet;
+/* the meter's memory holds this many records (see also MAX_RECORDS) */
+#define FACADE_MAX_RECORDS 500
 
-static unsigned char generic_ack[] = { 0x02, 0x06, 0x06, 0x03, 0xCD, 0x41 };
-static unsigned char generic_ack11[] = { 0x02, 0x06, 0x05, 0x03, 0x9e, 0x14 };
+static const unsigned char version_cmd[] = { 0x05, 0x0d, 0x02 };
+static const unsigned char version_reply[] = { 0x05, 0x06, 0x11, 0x50, 0x30, 0x32, 0x2e, 0x30, 0x30,
+					       0x2e, 0x30, 0x30, 0x32, 0x35, 0x2f, 0x30, 0x35, 0x2f,
+					       0x30, 0x37 };
 
-static unsigned char reset_key[] = { 0x02, 0x06, 0x08, 0x03, 0xc2, 0x62 };
-static unsigned char reset_ack[] = { 0x02, 0x06, 0x0C, 0x03, 0x06, 0xae };
+static const unsigned char serial_cmd[] = { 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00,
+					    0x84, 0x6a, 0xe8, 0x73, 0x00 };
+static const unsigned char serial_reply[] = { 0x05, 0x06, 0x43, 0x31, 0x37, 0x36, 0x53, 0x41,
+					      0x30, 0x4f, 0x30 };
 
-static unsigned char serial_key[] = { 0x02, 0x12, 0x00, 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00,
-				      0x84,0x6a, 0xe8, 0x73, 0x00, 0x03, 0x9b, 0xea };
-static unsigned char serial_reply[] = { 0x02, 0x11, 0x02, 0x05, 0x06, 0x43, 0x31, 0x37, 0x36, 0x53,
-					0x41, 0x30, 0x4F, 0x30, 0x03, 0x49, 0x43 };
+static const unsigned char real_serial_cmd[] = { 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00,
+						 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const unsigned char real_serial_reply[] = { 0x05, 0x06, 0x43, 0x47, 0x57, 0x41, 0x31, 0x45,
+						   0x35, 0x43, 0x52 };
 
-static unsigned char version_key[] = { 0x02, 0x09, 0x00, 0x05, 0x0D, 0x02, 0x03, 0xDA, 0x71 };
-static unsigned char version_reply[] = { 0x02, 0x1A, 0x02, 0x05, 0x06, 0x11, 0x50, 0x30, 0x32, 0x2E, 0x30,
-		                         0x30, 0x2E, 0x30, 0x30, 0x32, 0x35, 0x2F, 0x30, 0x35, 0x2F, 0x30,
-		                         0x37, 0x03, 0xAB, 0x25 };
+static const unsigned char read_rtc_cmd[] = { 0x05, 0x20, 0x02, 0x00, 0x00, 0x00, 0x00 };
+static const unsigned char read_rtc_reply[] = { 0x05, 0x06, 0x16, 0x35, 0x65, 0x4e };
 
-static unsigned char real_serial_key[] = {
-/*PC to meter:*/  0x02, 0x12, 0x00, 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x19, 0xe7,
-};
-static unsigned char real_serial_reply[] = {
-/*Meter to PC:*/  0x02, 0x11, 0x02, 0x05, 0x06, 0x43, 0x47, 0x57, 0x41, 0x31, 0x45, 0x35, 0x43, 0x52, 0x03, 0xb5, 0x5b,
+static const unsigned char read_settings_cmd[] = { 0x05, 0x09, 0x02, 0x09, 0x00, 0x00, 0x00, 0x00 };
+static const unsigned char read_settings_reply[] = { 0x05, 0x06, 0x01, 0x00, 0x00, 0x00 };
+
+static const facade_entry_t fixed_replies[] = {
+	{ ATOM(version_cmd), ATOM(version_reply) },
+	{ ATOM(serial_cmd), ATOM(serial_reply) },
+	{ ATOM(real_serial_cmd), ATOM(real_serial_reply) },
+	{ ATOM(read_rtc_cmd), ATOM(read_rtc_reply) },
+	{ ATOM(read_settings_cmd), ATOM(read_settings_reply) },
 };
 
+#define NUM_FIXED_REPLIES (sizeof(fixed_replies) / sizeof(fixed_replies[0]))
 
-static unsigned char other_reset_key[] = {
-/*PC to meter:*/  0x02, 0x06, 0x0a, 0x03, 0xa0, 0x04,
+/* must be a power of two comfortably larger than NUM_FIXED_REPLIES */
+#define FACADE_HASH_SIZE 16
+
+/* the records captured from a real meter (newest first) */
+static const struct {
+	uint32_t date;
+	uint32_t reading;
+} captured_records[] = {
+	{ 0x4e64d195, 0xc4 },
+	{ 0x4e6470a5, 0x50 },
+	{ 0x4e62186b, 0xac },
 };
 
-#if 0
-PC to meter:  0x02, 0x09, 0x00, 0x05, 0x0d, 0x02, 0x03, 0xda, 0x71,
-Meter to PC:  0x02, 0x06, 0x06, 0x03, 0xcd, 0x41,
-Meter to PC:  0x02, 0x1a, 0x02, 0x05, 0x06, 0x11, 0x50, 0x30, 0x32, 0x2e, 0x30, 0x30, 0x2e, 0x30, 0x30, 0x32, 0x35, 0x2f, 0x30, 0x35, 0x2f, 0x30, 0x37, 0x03, 0xab, 0x25,
-PC to meter:  0x02, 0x06, 0x07, 0x03, 0xfc, 0x72,
-#endif
+#define NUM_CAPTURED_RECORDS (sizeof(captured_records) / sizeof(captured_records[0]))
 
-static unsigned char serial_key11[] = {
-/*PC to meter:*/  0x02, 0x12, 0x03, 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0xba, 0x6a,
-};
-static unsigned char serial_reply11[] = {
-/*Meter to PC:*/  0x02, 0x11, 0x01, 0x05, 0x06, 0x43, 0x47, 0x57, 0x41, 0x31, 0x45, 0x35, 0x43, 0x52, 0x03, 0x10, 0x94,
-};
+#define FACADE_MAX_PENDING 2
 
-static unsigned char read_rtc_key11[] = {
-/*PC to meter:*/  0x02, 0x0d, 0x03, 0x05, 0x20, 0x02, 0x00, 0x00, 0x00, 0x00, 0x03, 0xa8, 0x4c,
-};
-static unsigned char read_rtc_reply11[] = {
-/*Meter to PC:*/  0x02, 0x0c, 0x01, 0x05, 0x06, 0x16, 0x35, 0x65, 0x4e, 0x03, 0x7e, 0x0e,
-};
+struct facade {
+	unsigned int num_records;
+	bool wire;
 
-static unsigned char read_settings_key[] = {
-/*PC to meter:*/  0x02, 0x0e, 0x00, 0x05, 0x09, 0x02, 0x09, 0x00, 0x00, 0x00, 0x00, 0x03, 0xce, 0xe7,
-};
-static unsigned char read_settings_reply[] = {
-/*Meter to PC:*/  0x02, 0x0c, 0x02, 0x05, 0x06, 0x01, 0x00, 0x00, 0x00, 0x03, 0x71, 0x6b,
-};
+	// index (plus one) into fixed_replies[] for each hash bucket
+	unsigned char hash[FACADE_HASH_SIZE];
 
-static unsigned char num_records_key11[] = {
-/*PC to meter:*/  0x02, 0x0a, 0x03, 0x05, 0x1f, 0x00, 0x02, 0x03, 0x29, 0x39,
-};
-static unsigned char num_records_reply11[] = {
-/*Meter to PC:*/  0x02, 0x0a, 0x01, 0x05, 0x0f, 0x03, 0x00, 0x03, 0xfc, 0x96,
-};
+	// meter's view of the sequence numbers
+	bool e;
+	bool s;
 
-static unsigned char get_sample0_key[] = {
-/*PC to meter:*/  0x02, 0x0a, 0x00, 0x05, 0x1f, 0x00, 0x00, 0x03, 0xab, 0x91,
-};
-static unsigned char get_sample0_reply[] = {
-/*Meter to PC:*/  0x02, 0x10, 0x02, 0x05, 0x06, 0x95, 0xd1, 0x64, 0x4e, 0xc4, 0x00, 0x00, 0x00, 0x03, 0x43, 0x4d,
-};
+	// the most recent reply (kept in case the PC asks again)
+	link_msg_t reply;
+	bool have_reply;
 
-static unsigned char get_sample1_key11[] = {
-/*PC to meter:*/  0x02, 0x0a, 0x03, 0x05, 0x1f, 0x01, 0x00, 0x03, 0x7b, 0x68,
-};
-static unsigned char get_sample1_reply11[] = {
-/*Meter to PC:*/  0x02, 0x10, 0x01, 0x05, 0x06, 0xa5, 0x70, 0x64, 0x4e, 0x50, 0x00, 0x00, 0x00, 0x03, 0x68, 0xd2,
+	// packets waiting to be collected by facade_rx_packet()
+	unsigned char pending[FACADE_MAX_PENDING][LEN_MAX];
+	uint64_t pending_time[FACADE_MAX_PENDING];
+	unsigned int num_pending;
+	unsigned int next_pending;
 };
 
-static unsigned char get_sample2_key[] = {
-/*PC to meter:*/  0x02, 0x0a, 0x00, 0x05, 0x1f, 0x02, 0x00, 0x03, 0xcb, 0xff,
-};
-static unsigned char get_sample2_reply[] = {
-/*Meter to PC:*/  0x02, 0x10, 0x02, 0x05, 0x06, 0x6b, 0x18, 0x62, 0x4e, 0xac, 0x00, 0x00, 0x00, 0x03, 0xd1, 0xc2,
-};
+static unsigned int hash_msg(const unsigned char *p, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
 
+	for (unsigned int i=0; i<len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
 
-facade_data_t default_facade[] = {
-#define TUPLE(x, y, z) { { x, sizeof(x) }, { { y, sizeof(y) }, { z, sizeof(z) }, { NULL } } }
-	TUPLE(reset_key, reset_ack, reset_key),
-	TUPLE(version_key, generic_ack, version_reply),
-	TUPLE(serial_key, generic_ack, serial_reply),
-	TUPLE(real_serial_key, generic_ack, real_serial_reply),
-	TUPLE(other_reset_key, reset_ack, reset_ack),
-	TUPLE(serial_key11, generic_ack11, serial_reply11),
-	TUPLE(read_rtc_key11, generic_ack11, read_rtc_reply11),
-	TUPLE(read_settings_key, generic_ack, read_settings_reply),
-	TUPLE(num_records_key11, generic_ack11, num_records_reply11),
-	TUPLE(get_sample0_key, generic_ack, get_sample0_reply),
-	TUPLE(get_sample1_key11, generic_ack11, get_sample1_reply11),
-	TUPLE(get_sample2_key, generic_ack, get_sample2_reply),
-
-#undef TUPLE
-	{ { NULL } }
-};
+	return hash & (FACADE_HASH_SIZE - 1);
+}
+
+static void build_hash(facade_t *facade)
+{
+	for (unsigned int i=0; i<NUM_FIXED_REPLIES; i++) {
+		unsigned int h = hash_msg(fixed_replies[i].cmd, fixed_replies[i].cmdlen);
+		while (facade->hash[h])
+			h = (h + 1) & (FACADE_HASH_SIZE - 1);
+		facade->hash[h] = i + 1;
+	}
+}
+
+static const facade_entry_t *lookup_fixed_reply(facade_t *facade, const link_msg_t *cmd)
+{
+	unsigned int h = hash_msg(cmd->data, cmd->len);
+
+	for (; facade->hash[h]; h = (h + 1) & (FACADE_HASH_SIZE - 1)) {
+		const facade_entry_t *entry = &fixed_replies[facade->hash[h] - 1];
+		if (entry->cmdlen == cmd->len && 0 == memcmp(entry->cmd, cmd->data, cmd->len))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Get a record (records beyond those captured from a real meter are made
+ * up, a few hours apart, with readings between 40 and 400 mg/dl).
+ */
+static void get_record(unsigned int num, uint32_t *date, uint32_t *reading)
+{
+	if (num < NUM_CAPTURED_RECORDS) {
+		*date = captured_records[num].date;
+		*reading = captured_records[num].reading;
+		return;
+	}
+
+	uint32_t hash = (num * 2654435761u) >> 8;
+	unsigned int n = num - NUM_CAPTURED_RECORDS + 1;
+
+	*date = captured_records[NUM_CAPTURED_RECORDS-1].date - (n * 6 * 60 * 60) - (hash % 3600);
+	*reading = 40 + ((hash >> 12) % 361);
+}
+
+/**
+ * Work out the meter's reply to a command.
+ *
+ * Returns false if the meter does not understand the command.
+ */
+static bool make_reply(facade_t *facade, const link_msg_t *cmd, link_msg_t *reply)
+{
+	const facade_entry_t *entry = lookup_fixed_reply(facade, cmd);
+	if (entry) {
+		reply->len = entry->replylen;
+		memcpy(reply->data, entry->reply, entry->replylen);
+		return true;
+	}
+
+	if (4 != cmd->len || 0x05 != cmd->data[0] || 0x1f != cmd->data[1])
+		return false;
+
+	unsigned int num = cmd->data[2] | (cmd->data[3] << 8);
+
+	// number of records
+	if (0x0200 == num) {
+		reply->len = 4;
+		reply->data[0] = 0x05;
+		reply->data[1] = 0x0f;
+		reply->data[2] = facade->num_records & 0xff;
+		reply->data[3] = facade->num_records >> 8;
+		return true;
+	}
+
+	if (num >= facade->num_records)
+		return false;
+
+	uint32_t date, reading;
+	get_record(num, &date, &reading);
+
+	reply->len = 10;
+	reply->data[0] = 0x05;
+	reply->data[1] = 0x06;
+	put_u32(reply->data + 2, date);
+	put_u32(reply->data + 6, reading);
+	return true;
+}
+
+/**
+ * Queue a packet for facade_rx_packet(), working out when it will have
+ * arrived if the wire time is being modelled.
+ */
+static void queue_packet(facade_t *facade, unsigned char link, const link_msg_t *msg, uint64_t *now)
+{
+	unsigned char *p = facade->pending[facade->num_pending];
+	unsigned int len = LEN_MIN + (msg ? msg->len : 0);
 
-void facade_tx_packet(unsigned char *p, unsigned int len)
+	p[OFFSET_STX] = STX;
+	p[OFFSET_LEN] = len;
+	p[OFFSET_LINK] = link;
+	if (msg)
+		memcpy(p + OFFSET_MSG, msg->data, msg->len);
+	p[OFFSET_ETX(p)] = ETX;
+
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, p, len - 2);
+	p[OFFSET_CRC_LO(p)] = crc & 0xff;
+	p[OFFSET_CRC_HI(p)] = crc >> 8;
+
+	*now += len * LINK_US_PER_BYTE;
+	facade->pending_time[facade->num_pending++] = *now;
+}
+
+static unsigned char link_bits(bool disconnect, bool acknowledge, bool e, bool s)
 {
-	next_packet = NULL;
+	return (disconnect << LINK_DISCONNECT) | (acknowledge << LINK_ACKNOWLEDGE) |
+	       (e << LINK_E) | (s << LINK_S);
+}
 
-	for(facade_data_t *f = default_facade; f->key.p; f++) {
-		if ((f->key.len == len) && (0 == memcmp(f->key.p, p, len))) {
-			next_packet = f->packets;
+facade_t *facade_open(const char *options)
+{
+	facade_t *facade = xzalloc(sizeof(facade_t));
+	facade->num_records = NUM_CAPTURED_RECORDS;
+	build_hash(facade);
 
-			char *tx = xstrdup_hexdump(p, len);
-			DEBUG("Received recognised packet (%s)\n", tx);
-			free(tx);
-			break;
+	char *opts = xstrdup(options ? options : "");
+	char *saveptr;
+	for (char *opt = strtok_r(opts, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr)) {
+		if (0 == strncmp(opt, "records=", 8)) {
+			char *end;
+			unsigned long num = strtoul(opt + 8, &end, 0);
+			if (*end)
+				goto handle_error;
+			if (num > FACADE_MAX_RECORDS) {
+				ERROR("The meter cannot hold more than %u records (not %lu)\n",
+				      FACADE_MAX_RECORDS, num);
+				goto handle_options_error;
+			}
+			facade->num_records = num;
+		} else if (0 == strcmp(opt, "wire")) {
+			facade->wire = true;
+		} else {
+			goto handle_error;
 		}
 	}
+
+	free(opts);
+	return facade;
+
+    handle_error:
+	ERROR("Bad facade option '%s'\n", options);
+    handle_options_error:
+	free(opts);
+	free(facade);
+	errno = EINVAL;
+	return NULL;
 }
 
-int facade_rx_packet(unsigned char *p, unsigned int len)
+/**
+ * Accept a packet from the PC and prepare the meter's response.
+ */
+void facade_tx_packet(facade_t *facade, const unsigned char *p, unsigned int len)
 {
-	if (!next_packet) {
+	uint64_t now = us_gettime(CLOCK_MONOTONIC) + (len * LINK_US_PER_BYTE);
+
+	facade->num_pending = 0;
+	facade->next_pending = 0;
+
+	if (!frame_is_valid(p, len) || (p[OFFSET_LINK] & LINK_RESERVED_MASK)) {
+		DEBUG("Ignoring corrupt packet\n");
+		return;
+	}
+
+	bool disconnect = p[OFFSET_LINK] & (1 << LINK_DISCONNECT);
+	bool acknowledge = p[OFFSET_LINK] & (1 << LINK_ACKNOWLEDGE);
+	bool e = p[OFFSET_LINK] & (1 << LINK_E);
+	bool s = p[OFFSET_LINK] & (1 << LINK_S);
+
+	if (disconnect) {
+		facade->e = false;
+		facade->s = false;
+		facade->have_reply = false;
+		queue_packet(facade, link_bits(true, true, false, false), NULL, &now);
+		return;
+	}
+
+	// the PC's E bit tells us the sequence number it expects from us next
+	// (this is normally changed by an ACK but a later packet will also do
+	// if the ACK went missing)
+	facade->s = e;
+
+	if (acknowledge)
+		return;
+
+	if (s == facade->e) {
+		link_msg_t cmd = { .len = len - LEN_MIN };
+		memcpy(cmd.data, p + OFFSET_MSG, cmd.len);
+
+		facade->have_reply = make_reply(facade, &cmd, &facade->reply);
+		if (!facade->have_reply) {
+			char *hex = xstrdup_hexdump(cmd.data, cmd.len);
+			DEBUG("Unrecognised command (%s)\n", hex);
+			free(hex);
+		}
+		facade->e = !facade->e;
+	} else {
+		DEBUG("Repeating reply to duplicate command\n");
+	}
+
+	queue_packet(facade, link_bits(false, true, facade->e, facade->s), NULL, &now);
+	if (facade->have_reply)
+		queue_packet(facade, link_bits(false, false, facade->e, facade->s), &facade->reply, &now);
+}
+
+/**
+ * Collect the meter's next packet.
+ */
+int facade_rx_packet(facade_t *facade, unsigned char *p, unsigned int maxlen)
+{
+	if (facade->next_pending >= facade->num_pending) {
 		DEBUG("No packet availabe\n");
 		errno = ENOLINK;
 		return -1;
 	}
 
-	assert(next_packet->len <= len);
-	memcpy(p, next_packet->p, next_packet->len);
+	unsigned int i = facade->next_pending++;
+	unsigned int len = facade->pending[i][OFFSET_LEN];
+
+	if (len > maxlen) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (facade->wire)
+		ms_sleep_until(CLOCK_MONOTONIC, (facade->pending_time[i] + 999) / 1000);
 
-	char *rx = xstrdup_hexdump(p, next_packet->len);
-	DEBUG("Sending packet (%s)\n", rx);
-	free(rx);
+	memcpy(p, facade->pending[i], len);
+
+	if (trace_level >= 2) {
+		char *rx = xstrdup_hexdump(p, len);
+		DEBUG("Sending packet (%s)\n", rx);
+		free(rx);
+	}
 
-	next_packet++;
 	return 0;
 }
+
+void facade_close(facade_t *facade)
+{
+	free(facade);
+}
@@ -19,7 +19,11 @@
 #ifndef FACADE_H_
 #define FACADE_H_
 
-void facade_tx_packet(unsigned char *p, unsigned int len);
-int facade_rx_packet(unsigned char *p, unsigned int maxlen);
+typedef struct facade facade_t;
+
+facade_t *facade_open(const char *options);
+void facade_tx_packet(facade_t *facade, const unsigned char *p, unsigned int len);
+int facade_rx_packet(facade_t *facade, unsigned char *p, unsigned int maxlen);
+void facade_close(facade_t *facade);
 
 #endif /* FACADE_H_ */
@@ -0,0 +1,155 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc.h"
+#include "framer.h"
+
+/**
+ * Check the framing (STX, LEN, ETX and CRC) of a candidate frame.
+ *
+ * len is the number of bytes available at p and must be at least the
+ * length recorded in the frame's LEN field.
+ */
+bool frame_is_valid(const unsigned char *p, unsigned int len)
+{
+	if (len < LEN_MIN || STX != p[OFFSET_STX])
+		return false;
+
+	if (p[OFFSET_LEN] < LEN_MIN || p[OFFSET_LEN] > LEN_MAX || p[OFFSET_LEN] > len)
+		return false;
+
+	if (ETX != p[OFFSET_ETX(p)])
+		return false;
+
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, p, p[OFFSET_LEN]-2);
+	return (crc & 0xff) == p[OFFSET_CRC_LO(p)] && (crc >> 8) == p[OFFSET_CRC_HI(p)];
+}
+
+/**
+ * Throw away any buffered data.
+ */
+void framer_reset(framer_t *f)
+{
+	f->len = 0;
+}
+
+/**
+ * Report how many more bytes can be appended to the buffer.
+ */
+unsigned int framer_space(const framer_t *f)
+{
+	return sizeof(f->buf) - f->len;
+}
+
+/**
+ * Report the length of the frame at the head of the buffer.
+ *
+ * Returns false (leaving len untouched) if the length is not yet known.
+ * LEN_MAX is itself a legal length so it cannot double as "unknown".
+ */
+bool framer_expected_len(const framer_t *f, unsigned int *len)
+{
+	if (f->len <= OFFSET_LEN || STX != f->buf[OFFSET_STX] ||
+	    f->buf[OFFSET_LEN] < LEN_MIN || f->buf[OFFSET_LEN] > LEN_MAX)
+		return false;
+
+	*len = f->buf[OFFSET_LEN];
+	return true;
+}
+
+static void discard(framer_t *f, unsigned int len)
+{
+	assert(len <= f->len);
+
+	f->len -= len;
+	f->discarded += len;
+	memmove(f->buf, f->buf + len, f->len);
+}
+
+/**
+ * Search beyond the head of the buffer for a complete, valid frame.
+ *
+ * Returns the offset of the frame or 0 if there is none.
+ */
+static unsigned int resync_point(const framer_t *f)
+{
+	for (unsigned int i=1; i + LEN_MIN <= f->len; i++)
+		if (STX == f->buf[i] && frame_is_valid(f->buf + i, f->len - i))
+			return i;
+
+	return 0;
+}
+
+/**
+ * Extract the next complete frame from the buffer.
+ *
+ * Leading bytes that are not STX are discarded. A candidate frame whose
+ * LEN, ETX or CRC is wrong is assumed to be a false STX and the framer
+ * slides forward by one byte and scans again. Thus any junk in the stream
+ * is skipped without losing the valid frames that follow it.
+ *
+ * Returns the length of the frame copied to p (which must have space for
+ * LEN_MAX bytes) or 0 if more data is required.
+ */
+int framer_extract(framer_t *f, unsigned char *p)
+{
+	while (f->len) {
+		if (STX != f->buf[OFFSET_STX]) {
+			unsigned char *stx = memchr(f->buf, STX, f->len);
+			discard(f, stx ? (unsigned int) (stx - f->buf) : f->len);
+			continue;
+		}
+
+		if (f->len <= OFFSET_LEN)
+			return 0;
+
+		unsigned int len = f->buf[OFFSET_LEN];
+		if (len < LEN_MIN || len > LEN_MAX) {
+			discard(f, 1);
+			continue;
+		}
+
+		if (f->len < len) {
+			// a corrupt LEN could leave us waiting for data that will
+			// never come so check whether a complete frame follows
+			unsigned int i = resync_point(f);
+			if (!i)
+				return 0;
+			discard(f, i);
+			continue;
+		}
+
+		if (!frame_is_valid(f->buf, len)) {
+			f->rejected++;
+			discard(f, 1);
+			continue;
+		}
+
+		memcpy(p, f->buf, len);
+		f->len -= len;
+		memmove(f->buf, f->buf + len, f->len);
+		return len;
+	}
+
+	return 0;
+}
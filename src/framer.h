@@ -0,0 +1,73 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMER_H_
+#define FRAMER_H_
+
+#include <stdbool.h>
+
+#include "ue_link.h"
+
+#define OFFSET_STX  0
+#define STX 0x02
+
+#define OFFSET_LEN  1
+#define LEN_MIN 6
+#define LEN_MAX (LEN_MIN + LINK_MAX_MSG_LEN)
+
+#define OFFSET_LINK 2
+#define LINK_RESERVED_MASK ((1 << 7) | (1 << 6) | (1 << 5))
+#define LINK_MORE 4
+#define LINK_DISCONNECT 3
+#define LINK_ACKNOWLEDGE 2
+#define LINK_E 1
+#define LINK_S 0
+
+#define OFFSET_MSG  3
+
+#define OFFSET_ETX(p) (p[OFFSET_LEN] - 3)
+#define ETX 0x03
+
+#define OFFSET_CRC_LO(p) (OFFSET_ETX(p) + 1)
+#define OFFSET_CRC_HI(p) (OFFSET_ETX(p) + 2)
+
+/*
+ * Incremental framer for a stream of bytes from the meter (or the PC).
+ *
+ * Data is read directly into buf (at buf + len) and len updated. Frames are
+ * then pulled out using framer_extract().
+ */
+typedef struct framer {
+	unsigned char buf[256];
+	unsigned int len;
+
+	// total number of bytes discarded while resynchronizing
+	unsigned long discarded;
+
+	// total number of candidate frames that failed the ETX or CRC check
+	unsigned long rejected;
+} framer_t;
+
+void framer_reset(framer_t *f);
+unsigned int framer_space(const framer_t *f);
+bool framer_expected_len(const framer_t *f, unsigned int *len);
+int framer_extract(framer_t *f, unsigned char *p);
+
+bool frame_is_valid(const unsigned char *p, unsigned int len);
+
+#endif /* FRAMER_H_ */
@@ -0,0 +1,169 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feed noisy byte streams through the framer and check the frames that come
+ * out the other side.
+ *
+ * Usage: framertest
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crc.h"
+#include "framer.h"
+
+static const unsigned char ack[] = { 0x02, 0x06, 0x06, 0x03, 0xcd, 0x41 };
+static const unsigned char reply[] = { 0x02, 0x11, 0x02, 0x05, 0x06, 0x43, 0x31, 0x37, 0x36,
+				       0x53, 0x41, 0x30, 0x4f, 0x30, 0x03, 0x49, 0x43 };
+
+typedef struct {
+	const char *name;
+	unsigned char junk[8];
+	unsigned int junklen;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+	{ "clean", { 0 }, 0 },
+	{ "junk", { 0xff, 0x00 }, 2 },
+	{ "bad LEN", { 0x02, 0xff }, 2 },
+	{ "short LEN", { 0x02, 0x01, 0x02 }, 3 },
+	{ "long LEN", { 0x02, 0x20 }, 2 },
+	{ "maximum LEN", { 0x02, LEN_MAX }, 2 },
+	{ "bad CRC", { 0x02, 0x06, 0x06, 0x03, 0xcd, 0x42 }, 6 },
+	{ "bad ETX", { 0x02, 0x06, 0x06, 0x04, 0xcd, 0x41 }, 6 },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/**
+ * Build junk + ack + junk + reply and feed it to the framer in chunks of
+ * the given size, checking that exactly the ack and the reply emerge.
+ */
+static bool run(const scenario_t *s, unsigned int chunk)
+{
+	unsigned char stream[128];
+	unsigned int len = 0;
+
+	memcpy(stream + len, s->junk, s->junklen); len += s->junklen;
+	memcpy(stream + len, ack, sizeof(ack)); len += sizeof(ack);
+	memcpy(stream + len, s->junk, s->junklen); len += s->junklen;
+	memcpy(stream + len, reply, sizeof(reply)); len += sizeof(reply);
+
+	const unsigned char *expected[] = { ack, reply };
+	const unsigned int expected_len[] = { sizeof(ack), sizeof(reply) };
+	unsigned int num_frames = 0;
+
+	framer_t f = { .len = 0 };
+	unsigned char frame[LEN_MAX];
+
+	for (unsigned int i=0; i<len; i+=chunk) {
+		unsigned int n = (len - i < chunk ? len - i : chunk);
+		memcpy(f.buf + f.len, stream + i, n);
+		f.len += n;
+
+		int res;
+		while ((res = framer_extract(&f, frame)) > 0) {
+			if (num_frames >= 2 || res != expected_len[num_frames] ||
+			    0 != memcmp(frame, expected[num_frames], res)) {
+				fprintf(stderr, "%s (chunk %u): unexpected frame\n", s->name, chunk);
+				return false;
+			}
+			num_frames++;
+		}
+	}
+
+	if (num_frames != 2 || f.len != 0 || f.discarded != 2 * s->junklen) {
+		fprintf(stderr, "%s (chunk %u): got %u frames, %u bytes left, %lu discarded\n",
+			s->name, chunk, num_frames, f.len, f.discarded);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Feed a frame of the largest legal size to the framer in chunks of the
+ * given size, checking that its length is reported once LEN arrives and
+ * that the frame emerges intact.
+ */
+static bool run_max_len(unsigned int chunk)
+{
+	unsigned char stream[LEN_MAX];
+
+	stream[OFFSET_STX] = STX;
+	stream[OFFSET_LEN] = LEN_MAX;
+	stream[OFFSET_LINK] = 0;
+	for (unsigned int i=OFFSET_MSG; i<OFFSET_ETX(stream); i++)
+		stream[i] = i;
+	stream[OFFSET_ETX(stream)] = ETX;
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, stream, LEN_MAX - 2);
+	stream[OFFSET_CRC_LO(stream)] = crc & 0xff;
+	stream[OFFSET_CRC_HI(stream)] = crc >> 8;
+
+	framer_t f = { .len = 0 };
+	unsigned char frame[LEN_MAX];
+	unsigned int num_frames = 0;
+
+	for (unsigned int i=0; i<sizeof(stream); i+=chunk) {
+		unsigned int n = (sizeof(stream) - i < chunk ? sizeof(stream) - i : chunk);
+		memcpy(f.buf + f.len, stream + i, n);
+		f.len += n;
+
+		unsigned int len = 0;
+		bool known = framer_expected_len(&f, &len);
+		if (known != (f.len > OFFSET_LEN) || (known && len != LEN_MAX)) {
+			fprintf(stderr, "maximum frame (chunk %u): length %s after %u bytes\n",
+				chunk, known ? "wrong" : "unknown", f.len);
+			return false;
+		}
+
+		int res;
+		while ((res = framer_extract(&f, frame)) > 0) {
+			if (res != LEN_MAX || 0 != memcmp(frame, stream, LEN_MAX)) {
+				fprintf(stderr, "maximum frame (chunk %u): unexpected frame\n", chunk);
+				return false;
+			}
+			num_frames++;
+		}
+	}
+
+	if (num_frames != 1 || f.len != 0 || f.discarded != 0) {
+		fprintf(stderr, "maximum frame (chunk %u): got %u frames, %u bytes left, %lu discarded\n",
+			chunk, num_frames, f.len, f.discarded);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	bool ok = true;
+
+	for (unsigned int chunk=1; chunk<=64; chunk*=2)
+		ok = run_max_len(chunk) && ok;
+
+	for (unsigned int i=0; i<NUM_SCENARIOS; i++)
+		for (unsigned int chunk=1; chunk<=64; chunk*=2)
+			ok = run(&scenarios[i], chunk) && ok;
+
+	return ok ? 0 : 1;
+}
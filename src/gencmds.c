@@ -0,0 +1,96 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Generate commands.c from commands.def.
+ *
+ * Each command is framed, with its CRC, for all four combinations of the
+ * link's E and S bits so that nothing needs to be packed or checksummed
+ * when a command is sent.
+ *
+ * Usage: gencmds > commands.c
+ */
+
+#include <stdio.h>
+
+#include "crc.h"
+#include "framer.h"
+
+static const struct {
+	const char *name;
+	unsigned int len;
+	unsigned char msg[LINK_MAX_MSG_LEN];
+} commands[] = {
+#define COMMAND(name, ...) { #name, sizeof((unsigned char[]) { __VA_ARGS__ }), { __VA_ARGS__ } },
+#include "commands.def"
+#undef COMMAND
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static unsigned int pack_frame(unsigned char *p, const unsigned char *msg, unsigned int len,
+			       unsigned int es)
+{
+	p[OFFSET_STX] = STX;
+	p[OFFSET_LEN] = LEN_MIN + len;
+	p[OFFSET_LINK] = (((es >> 1) & 1) << LINK_E) | ((es & 1) << LINK_S);
+	for (unsigned int i=0; i<len; i++)
+		p[OFFSET_MSG + i] = msg[i];
+	p[OFFSET_ETX(p)] = ETX;
+
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, p, p[OFFSET_LEN]-2);
+	p[OFFSET_CRC_LO(p)] = crc & 0xff;
+	p[OFFSET_CRC_HI(p)] = crc >> 8;
+
+	return p[OFFSET_LEN];
+}
+
+int main(void)
+{
+	printf("/* Generated by gencmds from commands.def. Do not edit. */\n\n"
+	       "#include \"commands.h\"\n\n"
+	       "const link_cmd_t command_frames[NUM_CMDS] = {\n");
+
+	for (unsigned int i=0; i<NUM_COMMANDS; i++) {
+		unsigned char frame[LEN_MAX];
+		unsigned int len;
+
+		printf("\t[CMD_%s] = {\n", commands[i].name);
+		printf("\t\t.msg_len = %u,\n", commands[i].len);
+		printf("\t\t.frames = {\n");
+		for (unsigned int es=0; es<4; es++) {
+			len = pack_frame(frame, commands[i].msg, commands[i].len, es);
+
+			printf("\t\t\t{");
+			for (unsigned int j=0; j<len; j++)
+				printf("%s0x%02x", j ? ", " : " ", frame[j]);
+			printf(" },\n");
+		}
+		printf("\t\t},\n");
+		printf("\t},\n");
+	}
+
+	printf("};\n");
+
+	if (fflush(stdout) != 0 || ferror(stdout)) {
+		perror("gencmds");
+		return 1;
+	}
+
+	return 0;
+}
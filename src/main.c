@@ -18,51 +18,344 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <glob.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "sheet.h"
+#include "state.h"
 #include "ultraeasy.h"
 #include "util.h"
 
 typedef void (*foreach_reading_t)(void *, ultraeasy_record_t *);
 
-static int foreach_reading(ultraeasy_t *meter, foreach_reading_t fn, void *ctx)
+typedef struct session_options {
+	foreach_reading_t dumpfn;
+	bool want_sheet;
+	bool want_meter_time;
+	bool want_meter_serial;
+	bool want_meter_version;
+	bool want_adaptive_guard;
+	bool want_stats;
+	bool want_trace;
+
+	// record the link traffic to this file
+	const char *capture;
+
+	// record the phases of each session to this profile
+	ultraeasy_profile_t *profile;
+
+	// add every reading downloaded to this store
+	ultraeasy_store_t *store;
+	const char *store_path;
+
+	// per-meter state used for incremental and resumable downloads
+	const char *state_dir;
+	bool incremental;
+	bool resume;
+
+	// tag the output with the meter's serial number
+	bool tagged;
+} session_options_t;
+
+/* give up on a pass through the records after this many failures in a row */
+#define MAX_CONSECUTIVE_FAILURES 3
+
+/**
+ * Save the checkpoint for a partial download (including the retry queue).
+ */
+static int save_checkpoint(const char *path, meter_state_t *progress, const meter_state_t *retry)
+{
+	progress->failed = retry->failed;
+	progress->num_failed = retry->num_failed;
+
+	int res = state_save(path, progress);
+
+	progress->failed = NULL;
+	progress->num_failed = 0;
+	return res;
+}
+
+static bool same_reading(bool have_reading, uint32_t date, uint32_t reading,
+			 const ultraeasy_record_t *record)
+{
+	return have_reading && date == record->raw.date && reading == record->raw.reading;
+}
+
+/* state shared between foreach_reading() and download_record() */
+typedef struct download {
+	const session_options_t *opts;
+	foreach_reading_t fn;
+	void *ctx;
+	FILE *f;
+
+	const meter_state_t *state;
+	meter_state_t *progress;
+	const meter_state_t *retry;
+	const char *path;
+	const char *serial;
+
+	unsigned int next;	// the record we expect next
+	int count;
+	int added;		// readings that were new to the store
+	int failures;		// consecutive failures
+	bool done;		// reached a reading we have already seen
+	bool failed;		// cannot save a checkpoint (or update the store)
+} download_t;
+
+/**
+ * Report a reading (and add it to the store if we are keeping one).
+ */
+static int emit_reading(download_t *d, ultraeasy_record_t *record)
+{
+	if (d->fn)
+		d->fn(d->ctx, record);
+	d->count++;
+
+	if (d->opts->store) {
+		int res = ultraeasy_store_add(d->opts->store, d->serial, record);
+		if (res < 0) {
+			fprintf(stderr, "Cannot add reading to %s: %s\n",
+					d->opts->store_path, strerror(errno));
+			d->failed = true;
+			return -1;
+		}
+		d->added += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Handle a record as it arrives from the meter (see ultraeasy_foreach_record()).
+ */
+static int download_record(void *ctx, unsigned int num, const ultraeasy_record_t *reading)
+{
+	download_t *d = ctx;
+	ultraeasy_record_t record = *reading;
+
+	d->failures = 0;
+	d->next = num + 1;
+
+	if (d->opts->incremental &&
+	    same_reading(d->state->have_newest, d->state->newest_date, d->state->newest_reading, &record)) {
+		DEBUG("Record %u has already been seen\n", num);
+		d->done = true;
+		return 1;
+	}
+
+	if (0 != emit_reading(d, &record))
+		return 1;
+
+	// let whoever is reading our output see each reading as soon as possible
+	fflush(d->f);
+
+	if (d->opts->resume) {
+		d->progress->next_record = num + 1;
+		if (0 != save_checkpoint(d->path, d->progress, d->retry)) {
+			d->failed = true;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Report every reading in the meter (newest first) by calling fn with ctx
+ * (f is flushed after each reading).
+ *
+ * In incremental mode only the readings newer than the newest reading from
+ * the last (successful) call are reported.
+ *
+ * In resume mode progress is checkpointed after every record. Records that
+ * cannot be read are queued and retried at the end of the download and, if
+ * they still cannot be read, are recorded in the checkpoint. A later call
+ * will continue from the checkpoint (provided the meter has not recorded any
+ * new readings in the meantime).
+ */
+static int foreach_reading(ultraeasy_t *meter, foreach_reading_t fn, void *ctx, FILE *f,
+			   const session_options_t *opts)
 {
-	int n = ultraeasy_num_records(meter);
+	meter_state_t state = { 0 };
+	meter_state_t progress = { 0 };
+	meter_state_t retry = { 0 };
+	char *path = NULL;
+	int status = -1;
+	int i, n;
+
+	download_t d = {
+		.opts = opts,
+		.fn = fn,
+		.ctx = ctx,
+		.f = f,
+		.state = &state,
+		.progress = &progress,
+		.retry = &retry,
+	};
+
+	uint64_t start = ms_gettime(CLOCK_MONOTONIC);
+
+	char *serial = NULL;
+	if (opts->state_dir || opts->store) {
+		serial = ultraeasy_read_serial(meter);
+		if (NULL == serial) {
+			fprintf(stderr, "Cannot read meter serial number: %s\n", strerror(errno));
+			return -1;
+		}
+		d.serial = serial;
+	}
+
+	if (opts->state_dir) {
+		path = state_path(opts->state_dir, serial);
+		if (NULL == path)
+			goto out;
+		d.path = path;
+
+		if (0 != state_load(path, &state) && ENOENT != errno)
+			fprintf(stderr, "Ignoring previous state: %s\n", strerror(errno));
+	}
+
+	n = ultraeasy_num_records(meter);
 	if (n < 0) {
 		fprintf(stderr, "Cannot read number of records: %s\n", strerror(errno));
-		return -1;
+		goto out;
+	}
+
+	ultraeasy_record_t newest = { 0 };
+	if (n > 0 && 0 != ultraeasy_get_record(meter, 0, &newest)) {
+		fprintf(stderr, "Cannot read record 0: %s\n", strerror(errno));
+		goto out;
+	}
+
+	// decide whether we can pick up where a previous download left off
+	bool resuming = opts->resume && n > 0 && state.have_partial &&
+			state.partial_records == n &&
+			same_reading(true, state.partial_date, state.partial_reading, &newest);
+	if (resuming) {
+		DEBUG("Resuming download from record %u\n", state.next_record);
+		retry.failed = state.failed;
+		retry.num_failed = state.num_failed;
+		state.failed = NULL;
+		state.num_failed = 0;
 	}
 
-	for (int i=0; i<n; i++) {
+	progress.num_records = state.num_records;
+	progress.have_newest = state.have_newest;
+	progress.newest_date = state.newest_date;
+	progress.newest_reading = state.newest_reading;
+	progress.have_partial = true;
+	progress.partial_records = n;
+	progress.partial_date = newest.raw.date;
+	progress.partial_reading = newest.raw.reading;
+
+	i = resuming ? state.next_record : 0;
+
+	// we already have the newest record
+	if (0 == i && n > 0) {
+		download_record(&d, 0, &newest);
+		i = 1;
+	}
+
+	while (i < n && !d.done && !d.failed) {
+		d.next = i;
+		int res = ultraeasy_foreach_record(meter, i, n - i, download_record, &d);
+		i = d.next;
+		if (0 == res)
+			continue;
+
+		fprintf(stderr, "Cannot read record %d: %s\n", i, strerror(errno));
+		if (!opts->resume)
+			goto out;
+
+		state_add_failed(&retry, i++);
+		if (++d.failures >= MAX_CONSECUTIVE_FAILURES)
+			break;
+	}
+	if (d.failed)
+		goto out;
+	progress.next_record = d.done ? n : i;
+
+	// work through the retry queue
+	for (int j=0; j<retry.num_failed; j++) {
 		ultraeasy_record_t record;
-		int res = ultraeasy_get_record(meter, i, &record);
-		if (res < 0) {
-			fprintf(stderr, "Cannot read record %d: %s\n", i, strerror(errno));
-			return -1;
+		unsigned int num = retry.failed[j];
+
+		if (0 != ultraeasy_get_record(meter, num, &record)) {
+			fprintf(stderr, "Cannot read record %u: %s\n", num, strerror(errno));
+			state_add_failed(&progress, num);
+			continue;
 		}
 
-		fn(ctx, &record);
+		if (0 != emit_reading(&d, &record))
+			goto out;
 	}
 
-	return 0;
+	// the download is only complete if every record has been read
+	if (progress.num_failed || progress.next_record < n) {
+		fprintf(stderr, "Download incomplete (%u records could not be read)\n",
+				progress.num_failed + (n - progress.next_record));
+		if (path)
+			(void) state_save(path, &progress);
+		goto out;
+	}
+
+	if (path) {
+		meter_state_t complete = {
+			.num_records = n,
+			.have_newest = n > 0,
+			.newest_date = newest.raw.date,
+			.newest_reading = newest.raw.reading,
+		};
+
+		if (0 != state_save(path, &complete))
+			goto out;
+	}
+
+	status = 0;
+
+    out:
+	{
+		uint64_t elapsed = ms_gettime(CLOCK_MONOTONIC) - start;
+		TRACE("Read %d records in %.2f seconds (%.2f records/sec)\n",
+				d.count, elapsed / 1000.0, elapsed ? (d.count * 1000.0) / elapsed : 0.0);
+	}
+
+	if (opts->store) {
+		if (0 == ultraeasy_store_commit(opts->store))
+			fprintf(stderr, "Stored %d new readings from meter %s (%d already stored)\n",
+					d.added, serial, d.count - d.added);
+		else
+			status = -1;
+	}
+
+	state_free(&progress);
+	state_free(&retry);
+	state_free(&state);
+	free(path);
+	free(serial);
+	return status;
 }
 
 static void show_raw_reading(void *ctx, ultraeasy_record_t *reading)
 {
-	printf("Raw date 0x%08x   Raw reading 0x%08x\n",
+	FILE *f = ctx;
+
+	fprintf(f, "Raw date 0x%08x   Raw reading 0x%08x\n",
 			reading->raw.date, reading->raw.reading);
 }
 
 static void show_reading(void *ctx, ultraeasy_record_t *reading)
 {
+	FILE *f = ctx;
 	struct tm exploded;
 	gmtime_r(&reading->date, &exploded);
 
-	printf("%4d-%02d-%02d %02d:%02d:%02d    %4.1f mmol/l\n",
+	fprintf(f, "%4d-%02d-%02d %02d:%02d:%02d    %4.1f mmol/l\n",
 			exploded.tm_year + 1900, exploded.tm_mon+1, exploded.tm_mday,
 			exploded.tm_hour, exploded.tm_min, exploded.tm_sec,
 			reading->mmol_per_litre);
@@ -70,57 +363,304 @@ static void show_reading(void *ctx, ultraeasy_record_t *reading)
 
 static void show_csv_reading(void *ctx, ultraeasy_record_t *reading)
 {
+	FILE *f = ctx;
 	struct tm exploded;
 	gmtime_r(&reading->date, &exploded);
 
-	printf("\"%02d-%02d-%04d\", \"%02d:%02d:%02d\", \"%3.1f\"\n",
+	fprintf(f, "\"%02d-%02d-%04d\", \"%02d:%02d:%02d\", \"%3.1f\"\n",
 				exploded.tm_mday, exploded.tm_mon+1, exploded.tm_year + 1900,
 				exploded.tm_hour, exploded.tm_min, exploded.tm_sec,
 				reading->mmol_per_litre);
 }
 
-static void show_meter_rtc(ultraeasy_t *meter)
+static void show_sheet_reading(void *ctx, ultraeasy_record_t *reading)
+{
+	sheet_add(ctx, reading);
+}
+
+static void show_meter_rtc(const ultraeasy_info_t *info, time_t local, int error, FILE *f)
 {
-	time_t local, rtc;
+	time_t rtc = info->rtc;
 
-	local = time(NULL);
-	rtc = ultraeasy_read_rtc(meter);
-	if ((time_t) -1 == rtc) {
-		fprintf(stderr, "Cannot read meter real time clock: %s\n", strerror(errno));
+	if (!(info->valid & ULTRAEASY_INFO_RTC)) {
+		fprintf(stderr, "Cannot read meter real time clock: %s\n", strerror(error));
+		rtc = (time_t) -1;
 	}
 
-	printf("Meter time: 0x%08llx (local 0x%08llx  delta %lld)\n",
+	fprintf(f, "Meter time: 0x%08llx (local 0x%08llx  delta %lld)\n",
 			(long long) rtc, (long long) local, (long long) (local - rtc));
 }
 
-static void show_meter_version(ultraeasy_t *meter)
+static void show_meter_version(const ultraeasy_info_t *info, int error, FILE *f)
 {
-	char *version;
+	const char *version = info->version;
 
-	version = ultraeasy_read_version(meter);
-	if (NULL == version) {
-		fprintf(stderr, "Cannot read meter version number: %s\n", strerror(errno));
-		version = xstrdup("(error)");
+	if (!(info->valid & ULTRAEASY_INFO_VERSION)) {
+		fprintf(stderr, "Cannot read meter version number: %s\n", strerror(error));
+		version = "(error)";
 	}
 
-	printf("Meter version: %s\n", version);
-	free(version);
+	fprintf(f, "Meter version: %s\n", version);
 }
 
-static void show_meter_serial(ultraeasy_t *meter)
+static void show_meter_serial(const ultraeasy_info_t *info, int error, FILE *f)
 {
-	char *serial;
+	const char *serial = info->serial;
 
-	serial = ultraeasy_read_serial(meter);
-	if (NULL == serial) {
-		fprintf(stderr, "Cannot read meter serial number: %s\n", strerror(errno));
-		serial = xstrdup("(error)");
+	if (!(info->valid & ULTRAEASY_INFO_SERIAL)) {
+		fprintf(stderr, "Cannot read meter serial number: %s\n", strerror(error));
+		serial = "(error)";
 	}
 
-	printf("Meter serial: %s\n", serial);
-	free(serial);
+	fprintf(f, "Meter serial: %s\n", serial);
+}
+
+/**
+ * Show the performance counters for a session.
+ *
+ * The report is written to stderr in one piece so that reports from
+ * sessions running in parallel do not get mixed up.
+ */
+static void show_stats(ultraeasy_t *meter, const char *device)
+{
+	ultraeasy_stats_t stats;
+	char *buf = NULL;
+	size_t len = 0;
+
+	ultraeasy_get_stats(meter, &stats);
+
+	FILE *f = open_memstream(&buf, &len);
+	if (NULL == f)
+		fatal("Out of memory");
+
+	fprintf(f, "Statistics for %s:\n", device);
+	fprintf(f, "  Packets sent: %llu (%llu bytes)\n",
+			(unsigned long long) stats.packets_tx, (unsigned long long) stats.bytes_tx);
+	fprintf(f, "  Packets received: %llu (%llu bytes)\n",
+			(unsigned long long) stats.packets_rx, (unsigned long long) stats.bytes_rx);
+	fprintf(f, "  CRC failures: %llu  Timeouts: %llu  Resets: %llu  Retries: %llu\n",
+			(unsigned long long) stats.crc_failures, (unsigned long long) stats.timeouts,
+			(unsigned long long) stats.resets, (unsigned long long) stats.retries);
+	fprintf(f, "  Guard sleep: %.3f seconds\n", stats.guard_sleep_us / 1000000.0);
+
+	for (int i=0; i<ULTRAEASY_NUM_COMMANDS; i++) {
+		const ultraeasy_command_stats_t *cmd = &stats.commands[i];
+		if (0 == cmd->count)
+			continue;
+
+		fprintf(f, "  %s: %llu (%llu failed)  mean %.1fms  max %.1fms\n   ",
+				ultraeasy_command_name(i), (unsigned long long) cmd->count,
+				(unsigned long long) cmd->failures,
+				cmd->total_us / (cmd->count * 1000.0), cmd->max_us / 1000.0);
+		for (int j=0; j<ULTRAEASY_LATENCY_BUCKETS; j++) {
+			if (0 == cmd->histogram[j])
+				continue;
+			if (j < ULTRAEASY_LATENCY_BUCKETS - 1)
+				fprintf(f, " <%ums: %llu", 1u << j, (unsigned long long) cmd->histogram[j]);
+			else
+				fprintf(f, " more: %llu", (unsigned long long) cmd->histogram[j]);
+		}
+		fprintf(f, "\n");
+	}
+
+	fclose(f);
+	fwrite(buf, 1, len, stderr);
+	free(buf);
+}
+
+/**
+ * Show the most recent link layer events for a session.
+ *
+ * Like show_stats() the report is written to stderr in one piece.
+ */
+static void show_trace(ultraeasy_t *meter, const char *device)
+{
+	char *buf = NULL;
+	size_t len = 0;
+
+	FILE *f = open_memstream(&buf, &len);
+	if (NULL == f)
+		fatal("Out of memory");
+
+	fprintf(f, "Link trace for %s:\n", device);
+	ultraeasy_dump_trace(meter, f);
+
+	fclose(f);
+	fwrite(buf, 1, len, stderr);
+	free(buf);
+}
+
+/**
+ * Connect to a meter and perform all the requested actions.
+ *
+ * Returns the exit status for the session.
+ */
+static int run_session(const session_options_t *opts, const char *device, FILE *f)
+{
+	ultraeasy_t *meter;
+	int status = 0;
+
+	meter = ultraeasy_open_profile(device, opts->capture, opts->profile);
+	if (NULL == meter) {
+		fprintf(stderr, "Cannot connect to meter (%s): %s\n", device, strerror(errno));
+		return 10;
+	}
+
+	if (opts->want_adaptive_guard)
+		ultraeasy_set_adaptive_guard(meter, true);
+
+	// fetch everything we need up front (the library caches all of it except
+	// the clock so the download below will not ask again)
+	unsigned int fields = 0;
+	bool want_download = opts->dumpfn || opts->store;
+	if (opts->want_meter_serial || opts->tagged ||
+	    (want_download && (opts->state_dir || opts->store)))
+		fields |= ULTRAEASY_INFO_SERIAL;
+	if (opts->want_meter_version)
+		fields |= ULTRAEASY_INFO_VERSION;
+	if (opts->want_meter_time)
+		fields |= ULTRAEASY_INFO_RTC;
+	if (want_download)
+		fields |= ULTRAEASY_INFO_NUM_RECORDS;
+
+	ultraeasy_info_t info;
+	time_t local = time(NULL);
+	int error = 0;
+	if (0 != ultraeasy_read_info(meter, fields, &info))
+		error = errno;
+
+	if (opts->want_meter_serial || opts->tagged)
+		show_meter_serial(&info, error, f);
+	if (opts->want_meter_version)
+		show_meter_version(&info, error, f);
+	if (opts->want_meter_time)
+		show_meter_rtc(&info, local, error, f);
+
+	if (want_download) {
+		sheet_t sheet;
+		void *ctx = f;
+		if (opts->want_sheet) {
+			sheet_begin(&sheet, f);
+			ctx = &sheet;
+		}
+
+		int res = foreach_reading(meter, opts->dumpfn, ctx, f, opts);
+		if (opts->want_sheet)
+			sheet_end(&sheet);
+		if (0 != res)
+			status = 12;
+	}
+
+	if (opts->want_stats)
+		show_stats(meter, device);
+	if (opts->want_trace)
+		show_trace(meter, device);
+
+	ultraeasy_close(meter);
+	return status;
+}
+
+typedef struct fleet {
+	const session_options_t *opts;
+	char **devices;
+	unsigned int num_devices;
+
+	pthread_mutex_t lock;
+	unsigned int next_device;
+	int status;
+} fleet_t;
+
+/**
+ * Worker thread for fleet downloads.
+ *
+ * Each session is written to a private memory stream and copied to stdout
+ * in one piece when the session is complete. This keeps the output from
+ * each meter together.
+ */
+static void *fleet_worker(void *arg)
+{
+	fleet_t *fleet = arg;
+
+	while (1) {
+		pthread_mutex_lock(&fleet->lock);
+		unsigned int i = fleet->next_device++;
+		pthread_mutex_unlock(&fleet->lock);
+
+		if (i >= fleet->num_devices)
+			break;
+
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&buf, &len);
+		if (NULL == f)
+			fatal("Out of memory");
+
+		int status = run_session(fleet->opts, fleet->devices[i], f);
+		fclose(f);
+
+		pthread_mutex_lock(&fleet->lock);
+		fwrite(buf, 1, len, stdout);
+		fflush(stdout);
+		if (status > fleet->status)
+			fleet->status = status;
+		pthread_mutex_unlock(&fleet->lock);
+
+		free(buf);
+	}
+
+	return NULL;
+}
+
+/**
+ * Download from several meters at once using a bounded pool of worker threads.
+ */
+static int run_fleet(const session_options_t *opts, char **devices,
+		     unsigned int num_devices, unsigned int num_jobs)
+{
+	fleet_t fleet = {
+		.opts = opts,
+		.devices = devices,
+		.num_devices = num_devices,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	if (num_jobs > num_devices)
+		num_jobs = num_devices;
+
+	pthread_t *workers = xzalloc(num_jobs * sizeof(pthread_t));
+	unsigned int num_workers;
+
+	for (num_workers = 0; num_workers < num_jobs; num_workers++) {
+		int res = pthread_create(&workers[num_workers], NULL, fleet_worker, &fleet);
+		if (0 != res) {
+			fprintf(stderr, "Cannot start worker thread: %s\n", strerror(res));
+			break;
+		}
+	}
+
+	// if no threads could be started then do the work ourselves
+	if (0 == num_workers)
+		(void) fleet_worker(&fleet);
+
+	for (int i=0; i<num_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	return fleet.status;
 }
 
+/* long options that have no short equivalent */
+enum {
+	OPT_RESUME = 256,
+	OPT_STATE_DIR,
+	OPT_CAPTURE,
+	OPT_STATS,
+	OPT_PROFILE,
+	OPT_SYNC_DB,
+	OPT_SHEET,
+	OPT_TRACE,
+};
+
 const char usage_text[] = "Usage: " PACKAGE " [OPTION]...\n";
 
 static void show_usage()
@@ -143,14 +683,42 @@ static void show_help()
 "monitor.\n"
 "\n"
 "Mandatory arguments to long options are mandatory for short options too.\n"
+"      --capture=FILE         record all traffic with the meter to FILE\n"
 "  -c, --csv                  extract meter readings in CSV format\n"
 "  -D, --device=DEVICE        choose a serial device (default: /dev/ttyUSB0)\n"
+"                             (can be supplied several times and may be a\n"
+"                             wildcard such as '/dev/ttyUSB*')\n"
+"                             use 'replay:FILE' or 'replay-fast:FILE' to play\n"
+"                             back a capture with its original timing or as\n"
+"                             fast as possible\n"
 "  -d, --dump                 show meter readings in plain text\n"
+"  -g, --adaptive-guard       shrink the inter-packet guard period to suit\n"
+"                             the meter (faster downloads)\n"
 "  -h, --help                 show this help text and exit\n"
+"  -i, --incremental          only show readings taken since the last\n"
+"                             download from the same meter\n"
+"  -j, --jobs=N               download from at most N meters at once\n"
+"                             (default: 8)\n"
+"      --profile=FILE         write a timeline of each session to FILE (in\n"
+"                             Trace Event Format, see chrome://tracing)\n"
 "  -t, --meter-time           show the meter's clock (time and date)\n"
 "  -s, --meter-serial         show the meter's serial number\n"
 "  -r, --meter-version        show the meter's version information\n"
 "  -R, --raw                  show raw meter readings in hex format\n"
+"      --resume               continue an interrupted download from where\n"
+"                             it left off\n"
+"      --sheet                extract meter readings as a spreadsheet with\n"
+"                             a row per day and a column per hour\n"
+"      --state-dir=DIR        keep the state used by --incremental and\n"
+"                             --resume in DIR\n"
+"                             (default: $HOME/.ultraeasy)\n"
+"      --stats                show link statistics and command latencies\n"
+"                             for each meter (on stderr)\n"
+"      --sync-db=FILE         add every new reading to the reading store\n"
+"                             FILE (which is created if needed)\n"
+"      --trace                show the most recent link layer events for\n"
+"                             each meter (on stderr, this is shown anyway\n"
+"                             if the link fails)\n"
 "  -V, --verbose              increase the level of internal logging\n"
 "                             (can be supplied several times)\n"
 "  -v, --version              output version information and exit\n"
@@ -166,59 +734,93 @@ int main(int argc, char *argv[])
 
 	bool bad_args = false;
 
-	char *device = "/dev/ttyUSB0";
-	foreach_reading_t dumpfn = NULL;
-	bool want_meter_time = false;
-	bool want_meter_serial = false;
-	bool want_meter_version = false;
+	glob_t devices = { 0 };
+	int glob_flags = GLOB_NOCHECK;
+	unsigned int num_jobs = 8;
+	session_options_t opts = { 0 };
+	bool want_incremental = false;
+	bool want_resume = false;
+	char *state_dir = NULL;
+	const char *profile = NULL;
+	const char *store = NULL;
 
 	static struct option long_options[] = {
+		{ "capture", 1, 0, OPT_CAPTURE },
 		{ "csv", 0, 0, 'c' },
 		{ "device", 1, 0, 'D' },
 		{ "dump", 0, 0, 'd' },
+		{ "adaptive-guard", 0, 0, 'g' },
 		{ "help", 0, 0, 'h' },
+		{ "incremental", 0, 0, 'i' },
+		{ "jobs", 1, 0, 'j' },
 		{ "meter-time", 0, 0, 't' },
 		{ "meter-serial", 0, 0, 's' },
 		{ "meter-version", 0, 0, 'r' },
+		{ "profile", 1, 0, OPT_PROFILE },
 		{ "raw", 0, 0, 'R' },
+		{ "resume", 0, 0, OPT_RESUME },
+		{ "sheet", 0, 0, OPT_SHEET },
+		{ "state-dir", 1, 0, OPT_STATE_DIR },
+		{ "stats", 0, 0, OPT_STATS },
+		{ "sync-db", 1, 0, OPT_SYNC_DB },
+		{ "trace", 0, 0, OPT_TRACE },
 		{ "verbose", 0, 0, 'V' },
 		{ "version", 0, 0, 'v' },
 		{0, 0, 0,  0 }
 	};
 
 
-	while (-1 != (c = getopt_long(argc, argv, "cD:dhtsrRVvZ", long_options, NULL))) {
+	while (-1 != (c = getopt_long(argc, argv, "cD:dghij:tsrRVvZ", long_options, NULL))) {
 		switch (c) {
 		case 'c': // --csv
-			dumpfn = show_csv_reading;
+			opts.dumpfn = show_csv_reading;
+			opts.want_sheet = false;
 			break;
 
 		case 'D': // --device
-			device = optarg;
+			if (GLOB_NOSPACE == glob(optarg, glob_flags, NULL, &devices))
+				fatal("Out of memory");
+			glob_flags |= GLOB_APPEND;
 			break;
 
 		case 'd': // --dump
-			dumpfn = show_reading;
+			opts.dumpfn = show_reading;
+			opts.want_sheet = false;
+			break;
+
+		case 'g': // --adaptive-guard
+			opts.want_adaptive_guard = true;
 			break;
 
 		case 'h': // --help
 			show_help();
 			return 0;
 
+		case 'i': // --incremental
+			want_incremental = true;
+			break;
+
+		case 'j': // --jobs
+			num_jobs = strtoul(optarg, NULL, 0);
+			if (num_jobs < 1)
+				bad_args = true;
+			break;
+
 		case 't': // --meter-time
-			want_meter_time = true;
+			opts.want_meter_time = true;
 			break;
 
 		case 's': // --meter-serial
-			want_meter_serial = true;
+			opts.want_meter_serial = true;
 			break;
 
 		case 'r': // --meter-version
-			want_meter_version = true;
+			opts.want_meter_version = true;
 			break;
 
 		case 'R': // --raw
-			dumpfn = show_raw_reading;
+			opts.dumpfn = show_raw_reading;
+			opts.want_sheet = false;
 			break;
 
 		case 'V': // --verbose
@@ -229,6 +831,39 @@ int main(int argc, char *argv[])
 			show_version();
 			return 0;
 
+		case OPT_RESUME: // --resume
+			want_resume = true;
+			break;
+
+		case OPT_STATE_DIR: // --state-dir
+			state_dir = optarg;
+			break;
+
+		case OPT_CAPTURE: // --capture
+			opts.capture = optarg;
+			break;
+
+		case OPT_STATS: // --stats
+			opts.want_stats = true;
+			break;
+
+		case OPT_TRACE: // --trace
+			opts.want_trace = true;
+			break;
+
+		case OPT_PROFILE: // --profile
+			profile = optarg;
+			break;
+
+		case OPT_SHEET: // --sheet
+			opts.dumpfn = show_sheet_reading;
+			opts.want_sheet = true;
+			break;
+
+		case OPT_SYNC_DB: // --sync-db
+			store = optarg;
+			break;
+
 		case 'Z': // no long opt
 			trace_level = 3;
 			break;
@@ -243,32 +878,65 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (!dumpfn && !want_meter_time && !want_meter_version && !want_meter_serial) {
+	if (!opts.dumpfn && !opts.want_meter_time && !opts.want_meter_version &&
+	    !opts.want_meter_serial && !store) {
 		fprintf(stderr, "No action requested\nTry '--help'\n");
 		return 2;
 	}
 
-	ultraeasy_t *meter;
+	if (want_incremental || want_resume) {
+		opts.incremental = want_incremental;
+		opts.resume = want_resume;
 
-	meter = ultraeasy_open(device);
-	if (NULL == meter) {
-		fprintf(stderr, "Cannot connect to meter: %s\n", strerror(errno));
-		return 10;
+		if (state_dir) {
+			opts.state_dir = state_dir;
+		} else {
+			const char *home = getenv("HOME");
+			opts.state_dir = xstrdup_printf("%s/.ultraeasy", home ? home : ".");
+		}
+	}
+
+	if (opts.capture && devices.gl_pathc > 1) {
+		fprintf(stderr, "--capture cannot be used with more than one device\n");
+		return 2;
 	}
 
-	if (want_meter_serial)
-		show_meter_serial(meter);
-	if (want_meter_version)
-		show_meter_version(meter);
-	if (want_meter_time)
-		show_meter_rtc(meter);
+	if (profile) {
+		opts.profile = ultraeasy_profile_create(profile);
+		if (NULL == opts.profile) {
+			fprintf(stderr, "Cannot create profile %s: %s\n", profile, strerror(errno));
+			return 1;
+		}
+	}
 
-	if (dumpfn) {
-		int res = foreach_reading(meter, dumpfn, NULL);
-		if (0 != res)
-			return 12;
+	if (store) {
+		opts.store = ultraeasy_store_open(store);
+		if (NULL == opts.store) {
+			fprintf(stderr, "Cannot open reading store %s: %s\n", store, strerror(errno));
+			return 1;
+		}
+		opts.store_path = store;
 	}
 
-	ultraeasy_close(meter);
-	return 0;
+	int status;
+	if (0 == devices.gl_pathc) {
+		status = run_session(&opts, "/dev/ttyUSB0", stdout);
+	} else if (1 == devices.gl_pathc) {
+		status = run_session(&opts, devices.gl_pathv[0], stdout);
+	} else {
+		opts.tagged = true;
+		status = run_fleet(&opts, devices.gl_pathv, devices.gl_pathc, num_jobs);
+	}
+	globfree(&devices);
+
+	if (opts.store)
+		(void) ultraeasy_store_close(opts.store);
+
+	if (opts.profile && 0 != ultraeasy_profile_close(opts.profile)) {
+		fprintf(stderr, "Cannot write profile %s: %s\n", profile, strerror(errno));
+		if (0 == status)
+			status = 1;
+	}
+
+	return status;
 }
@@ -0,0 +1,48 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/*
+ * Statically defined tracepoints (USDT) for bpftrace, perf, systemtap, etc.
+ *
+ * With <sys/sdt.h> each probe is a single nop plus a note in the ELF file
+ * describing where its arguments can be found, so a probe costs almost
+ * nothing until a tracer attaches to it. Without <sys/sdt.h> the probes
+ * compile to nothing (and their arguments are not evaluated).
+ *
+ * All the probes belong to the "ultraeasy" provider. See README for the
+ * list of probes and their arguments.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(ultraeasy, name)
+#define PROBE1(name, a) DTRACE_PROBE1(ultraeasy, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ultraeasy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ultraeasy, name, a, b, c)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+#endif
+
+#endif /* PROBES_H_ */
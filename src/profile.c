@@ -0,0 +1,180 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "util.h"
+
+struct profile {
+	FILE *f;
+	bool failed;
+
+	pthread_mutex_t lock;
+	uint64_t start;
+	unsigned int num_events;
+	unsigned int num_tracks;
+};
+
+/**
+ * Create a profile (replacing any existing file).
+ */
+profile_t *profile_create(const char *pathname)
+{
+	FILE *f = fopen(pathname, "w");
+	if (!f)
+		return NULL;
+
+	if (EOF == fputs("{\"traceEvents\":[", f)) {
+		fclose(f);
+		return NULL;
+	}
+
+	profile_t *profile = xzalloc(sizeof(profile_t));
+	profile->f = f;
+	pthread_mutex_init(&profile->lock, NULL);
+	profile->start = us_gettime(CLOCK_MONOTONIC);
+	return profile;
+}
+
+/**
+ * Write a single event (the caller must hold the lock).
+ *
+ * errno is preserved so that profiling never disturbs error reporting.
+ *
+ * name must not need escaping (every name we use is a literal). extra, if
+ * not NULL, is appended to the event's JSON object.
+ */
+static void write_event(profile_t *profile, char phase, unsigned int track,
+			const char *name, const char *extra)
+{
+	uint64_t ts = us_gettime(CLOCK_MONOTONIC) - profile->start;
+	int saved_errno = errno;
+
+	int res = fprintf(profile->f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%u%s}",
+			  profile->num_events ? "," : "", name, phase, (unsigned long long) ts,
+			  (int) getpid(), track, extra ? extra : "");
+	if (res < 0)
+		profile->failed = true;
+
+	profile->num_events++;
+	errno = saved_errno;
+}
+
+/**
+ * Allocate a new track and label it (with a device name, for example).
+ *
+ * Returns the track number (which is never zero).
+ */
+unsigned int profile_track(profile_t *profile, const char *name)
+{
+	if (!profile)
+		return 0;
+
+	// escape the name (which may be a device path)
+	char *escaped = xzalloc(2 * strlen(name) + 1);
+	for (char *p = escaped; *name; name++) {
+		if ('"' == *name || '\\' == *name)
+			*p++ = '\\';
+		*p++ = ((unsigned char) *name < ' ') ? '?' : *name;
+	}
+
+	pthread_mutex_lock(&profile->lock);
+	unsigned int track = ++profile->num_tracks;
+	char *args = xstrdup_printf(",\"args\":{\"name\":\"%s\"}", escaped);
+	free(escaped);
+	write_event(profile, 'M', track, "thread_name", args);
+	free(args);
+	pthread_mutex_unlock(&profile->lock);
+
+	return track;
+}
+
+/**
+ * Start a span. Spans on the same track must be properly nested.
+ */
+void profile_begin(profile_t *profile, unsigned int track, const char *name)
+{
+	if (!profile)
+		return;
+
+	pthread_mutex_lock(&profile->lock);
+	write_event(profile, 'B', track, name, NULL);
+	pthread_mutex_unlock(&profile->lock);
+}
+
+/**
+ * End the most recently started span on a track.
+ */
+void profile_end(profile_t *profile, unsigned int track, const char *name)
+{
+	if (!profile)
+		return;
+
+	pthread_mutex_lock(&profile->lock);
+	write_event(profile, 'E', track, name, NULL);
+	pthread_mutex_unlock(&profile->lock);
+}
+
+/**
+ * Mark a point in time (a retry or a timeout, for example).
+ */
+void profile_instant(profile_t *profile, unsigned int track, const char *name)
+{
+	if (!profile)
+		return;
+
+	pthread_mutex_lock(&profile->lock);
+	write_event(profile, 'i', track, name, ",\"s\":\"t\"");
+	pthread_mutex_unlock(&profile->lock);
+}
+
+/**
+ * Finish and close the profile.
+ *
+ * Returns -1 if any of the data could not be written.
+ */
+int profile_close(profile_t *profile)
+{
+	if (!profile)
+		return 0;
+
+	bool failed = profile->failed;
+
+	if (EOF == fputs("\n]}\n", profile->f))
+		failed = true;
+	if (0 != fclose(profile->f))
+		failed = true;
+	pthread_mutex_destroy(&profile->lock);
+	free(profile);
+
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+/*
+ * Timeline profiles in the Trace Event Format (the JSON format read by
+ * chrome://tracing, Perfetto and speedscope).
+ *
+ * Each link gets its own track (shown as a thread by the viewers) on which
+ * nested spans are recorded with profile_begin() and profile_end(). Events
+ * are written as they happen so a profile can be shared by several threads.
+ *
+ * All the functions except profile_create() accept a NULL profile (and do
+ * nothing) so callers need not check whether profiling is enabled.
+ */
+
+typedef struct profile profile_t;
+
+profile_t *profile_create(const char *pathname);
+unsigned int profile_track(profile_t *profile, const char *name);
+void profile_begin(profile_t *profile, unsigned int track, const char *name);
+void profile_end(profile_t *profile, unsigned int track, const char *name);
+void profile_instant(profile_t *profile, unsigned int track, const char *name);
+int profile_close(profile_t *profile);
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,212 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading archive query tool.
+ *
+ * Shows (or summarises) the readings in an archive that were taken by one
+ * meter, or by every meter, in a given time range. Only the parts of the
+ * archive that cover the range are read (see ultraeasy_archive_query()).
+ *
+ * Usage: ue-query [OPTION]... ARCHIVE
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "show.h"
+#include "ultraeasy.h"
+#include "util.h"
+
+static void show_summary(const ultraeasy_summary_t *summary)
+{
+	printf("Readings: %lu\n", summary->count);
+	if (0 == summary->count)
+		return;
+
+	printf("Minimum: %.1f mmol/l\n", summary->min_reading / 18.0);
+	printf("Maximum: %.1f mmol/l\n", summary->max_reading / 18.0);
+	printf("Mean: %.1f mmol/l\n", (double) summary->sum / (summary->count * 18.0));
+}
+
+/**
+ * Parse a date ("YYYY-MM-DD") or a date and time ("YYYY-MM-DD HH:MM:SS").
+ *
+ * The meter's clock has no time zone so, like the readings, the result is
+ * treated as UTC. A date on its own means the start of the day or, if end
+ * is true, the last second of the day.
+ */
+static int parse_date(const char *str, bool end, time_t *t)
+{
+	int year, month, day, hour = 0, min = 0, sec = 0;
+	char trailing;
+
+	int n = sscanf(str, "%d-%d-%d %d:%d:%d%c", &year, &month, &day, &hour, &min, &sec,
+		       &trailing);
+	if (3 == n && end) {
+		hour = 23;
+		min = 59;
+		sec = 59;
+	} else if (3 != n && 6 != n) {
+		return -1;
+	}
+
+	if (month < 1 || month > 12 || day < 1 || day > 31 ||
+	    hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 59)
+		return -1;
+
+	*t = utc_time(year, month, day, hour, min, sec);
+	return 0;
+}
+
+const char usage_text[] = "Usage: ue-query [OPTION]... ARCHIVE\n";
+
+static void show_help()
+{
+	printf(usage_text);
+
+	printf(
+"Show the readings in an archive that were taken in a given time range.\n"
+"\n"
+"  -d, --dump                 show the readings in plain text (default)\n"
+"  -f, --from=DATE            ignore readings taken before DATE\n"
+"  -h, --help                 show this help text and exit\n"
+"  -m, --meter=SERIAL         only show readings from the meter SERIAL\n"
+"  -R, --raw                  show the raw readings in hex format\n"
+"  -S, --sheet                show the readings as a spreadsheet with a row\n"
+"                             per day and a column per hour\n"
+"  -s, --summary              show the number of readings and their\n"
+"                             minimum, maximum and mean\n"
+"  -t, --to=DATE              ignore readings taken after DATE\n"
+"  -V, --verbose              show how much of the archive was read\n"
+"\n"
+"DATE is either 'YYYY-MM-DD' or 'YYYY-MM-DD HH:MM:SS' (in the meter's time).\n"
+"Readings are shown grouped by meter and then in date order.\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	show_t show = { .fn = show_reading };
+	const char *serial = NULL;
+	bool want_summary = false;
+	time_t from = 0, to = UINT32_MAX;
+	int c;
+
+	static struct option long_options[] = {
+		{ "dump", 0, 0, 'd' },
+		{ "from", 1, 0, 'f' },
+		{ "help", 0, 0, 'h' },
+		{ "meter", 1, 0, 'm' },
+		{ "raw", 0, 0, 'R' },
+		{ "sheet", 0, 0, 'S' },
+		{ "summary", 0, 0, 's' },
+		{ "to", 1, 0, 't' },
+		{ "verbose", 0, 0, 'V' },
+		{0, 0, 0,  0 }
+	};
+
+	while (-1 != (c = getopt_long(argc, argv, "df:hm:RSst:V", long_options, NULL))) {
+		switch (c) {
+		case 'd': // --dump
+			show.fn = show_reading;
+			show.want_sheet = false;
+			break;
+		case 'f': // --from
+			if (0 != parse_date(optarg, false, &from)) {
+				fprintf(stderr, "Bad date: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h': // --help
+			show_help();
+			return 0;
+		case 'm': // --meter
+			serial = optarg;
+			break;
+		case 'R': // --raw
+			show.fn = show_raw_reading;
+			show.want_sheet = false;
+			break;
+		case 'S': // --sheet
+			show.fn = show_reading;
+			show.want_sheet = true;
+			break;
+		case 's': // --summary
+			want_summary = true;
+			break;
+		case 't': // --to
+			if (0 != parse_date(optarg, true, &to)) {
+				fprintf(stderr, "Bad date: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'V': // --verbose
+			trace_level++;
+			break;
+		default:
+			fprintf(stderr, usage_text);
+			fprintf(stderr, "Try '--help'.\n");
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, usage_text);
+		fprintf(stderr, "Try '--help'.\n");
+		return 1;
+	}
+	const char *pathname = argv[optind];
+
+	ultraeasy_archive_t *archive = ultraeasy_archive_open(pathname);
+	if (NULL == archive) {
+		fprintf(stderr, "Cannot open archive %s: %s\n", pathname, strerror(errno));
+		return 1;
+	}
+
+	int res;
+	if (want_summary) {
+		ultraeasy_summary_t summary;
+
+		res = ultraeasy_archive_summarise(archive, serial, from, to, &summary);
+		if (0 == res) {
+			show_summary(&summary);
+			TRACE("Read %u blocks (skipped %u)\n",
+					summary.blocks_read, summary.blocks_skipped);
+		}
+	} else {
+		show.tagged = !serial;
+		res = ultraeasy_archive_query(archive, serial, from, to, show_meter_reading, &show);
+		if (0 == res)
+			show_end(&show);
+	}
+
+	ultraeasy_archive_close(archive);
+	if (0 != res) {
+		fprintf(stderr, "Cannot read archive %s: %s\n", pathname, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replay transport.
+ *
+ * Plays back the meter's side of a capture file. Each packet sent to the
+ * "meter" is matched against the next PC to meter frames in the capture and
+ * the meter to PC frames that followed it are returned, either with their
+ * original timing or as fast as possible.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "replay.h"
+#include "util.h"
+
+struct replay {
+	capture_record_t *records;
+	unsigned int num_records;
+	unsigned int next;
+	bool fast;
+
+	// timestamp of the matched TX record and the time we sent our copy of it
+	uint64_t tx_timestamp;
+	uint64_t tx_time;
+};
+
+replay_t *replay_open(const char *pathname, bool fast)
+{
+	unsigned int num_records;
+
+	capture_record_t *records = capture_load(pathname, &num_records);
+	if (!records)
+		return NULL;
+
+	replay_t *replay = xzalloc(sizeof(replay_t));
+	replay->records = records;
+	replay->num_records = num_records;
+	replay->fast = fast;
+	return replay;
+}
+
+/**
+ * Wait until the same time (relative to the last TX packet) as the capture.
+ */
+static void replay_wait(replay_t *replay, uint64_t timestamp)
+{
+	if (replay->fast)
+		return;
+
+	uint64_t deadline = replay->tx_time + (timestamp - replay->tx_timestamp);
+	ms_sleep_until(CLOCK_MONOTONIC, (deadline + 999) / 1000);
+}
+
+/**
+ * Find the packet we have sent in the capture.
+ *
+ * If the packet is not found any remaining replies to the previous packet
+ * are discarded (so the next receive will time out).
+ */
+void replay_tx_packet(replay_t *replay, const unsigned char *p, unsigned int len)
+{
+	replay->tx_time = us_gettime(CLOCK_MONOTONIC);
+
+	for (unsigned int i=replay->next; i<replay->num_records; i++) {
+		capture_record_t *r = &replay->records[i];
+
+		if (CAPTURE_TX == r->dir && r->len == len && 0 == memcmp(r->data, p, len)) {
+			if (i != replay->next)
+				DEBUG("Skipped %u records to find packet\n", i - replay->next);
+			replay->next = i + 1;
+			replay->tx_timestamp = r->timestamp;
+			return;
+		}
+	}
+
+	DEBUG("Packet not found in capture\n");
+	while (replay->next < replay->num_records &&
+	       CAPTURE_RX == replay->records[replay->next].dir)
+		replay->next++;
+}
+
+/**
+ * Return the next meter to PC frame from the capture.
+ *
+ * If the capture has no reply then this behaves like a real link that
+ * times out after timeout milliseconds.
+ */
+int replay_rx_packet(replay_t *replay, unsigned char *p, unsigned int len, unsigned int timeout)
+{
+	if (replay->next >= replay->num_records ||
+	    CAPTURE_RX != replay->records[replay->next].dir) {
+		if (!replay->fast)
+			ms_sleep_until(CLOCK_MONOTONIC, ms_gettime(CLOCK_MONOTONIC) + timeout);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	capture_record_t *r = &replay->records[replay->next++];
+
+	replay_wait(replay, r->timestamp);
+
+	if (r->len > len) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	memcpy(p, r->data, r->len);
+	return r->len;
+}
+
+void replay_close(replay_t *replay)
+{
+	free(replay->records);
+	free(replay);
+}
@@ -0,0 +1,31 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdbool.h>
+
+typedef struct replay replay_t;
+
+replay_t *replay_open(const char *pathname, bool fast);
+void replay_tx_packet(replay_t *replay, const unsigned char *p, unsigned int len);
+int replay_rx_packet(replay_t *replay, unsigned char *p, unsigned int len, unsigned int timeout);
+void replay_close(replay_t *replay);
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sheet.h"
+#include "util.h"
+
+/**
+ * Start a sheet (and write its header row).
+ */
+void sheet_begin(sheet_t *sheet, FILE *f)
+{
+	memset(sheet, 0, sizeof(*sheet));
+	sheet->f = f;
+
+	fprintf(f, "\"Date\",");
+	for (int i=0; i<24; i++)
+		fprintf(f, "\"%d:00\",", i);
+	fprintf(f, "\"Additional readings\",\n");
+}
+
+/**
+ * Write the current day's row.
+ *
+ * Readings are numbers and everything else (including empty cells) is
+ * quoted.
+ */
+static void issue_day(sheet_t *sheet)
+{
+	FILE *f = sheet->f;
+
+	if (!sheet->have_day)
+		return;
+
+	fprintf(f, "\"%04d-%02d-%02d\",", sheet->year, sheet->month, sheet->day);
+	for (int i=0; i<24; i++) {
+		if (sheet->hours[i][0])
+			fprintf(f, "%s,", sheet->hours[i]);
+		else
+			fprintf(f, "\"\",");
+	}
+	fprintf(f, "\"%s\",\n", sheet->additional ? sheet->additional : "");
+
+	free(sheet->additional);
+	sheet->additional = NULL;
+	sheet->additional_len = 0;
+	memset(sheet->hours, 0, sizeof(sheet->hours));
+	sheet->have_day = false;
+}
+
+/**
+ * Add a reading to the sheet.
+ *
+ * The first reading to arrive for each hour gets the hour's column. Any
+ * others are listed (with their time) in the additional readings column.
+ */
+void sheet_add(sheet_t *sheet, const ultraeasy_record_t *reading)
+{
+	struct tm exploded;
+	gmtime_r(&reading->date, &exploded);
+
+	int year = exploded.tm_year + 1900;
+	int month = exploded.tm_mon + 1;
+	if (!sheet->have_day || year != sheet->year || month != sheet->month ||
+	    exploded.tm_mday != sheet->day) {
+		issue_day(sheet);
+		sheet->have_day = true;
+		sheet->year = year;
+		sheet->month = month;
+		sheet->day = exploded.tm_mday;
+	}
+
+	char *hour = sheet->hours[exploded.tm_hour];
+	if (!hour[0]) {
+		snprintf(hour, sizeof(sheet->hours[0]), "%.1f", reading->mmol_per_litre);
+		return;
+	}
+
+	char *entry = xstrdup_printf("%s%02d:%02d:%02d %.1f",
+			sheet->additional ? ", " : "",
+			exploded.tm_hour, exploded.tm_min, exploded.tm_sec,
+			reading->mmol_per_litre);
+	size_t len = strlen(entry);
+	sheet->additional = xrealloc(sheet->additional, sheet->additional_len + len + 1);
+	memcpy(sheet->additional + sheet->additional_len, entry, len + 1);
+	sheet->additional_len += len;
+	free(entry);
+}
+
+/**
+ * Write the last row of the sheet.
+ */
+void sheet_end(sheet_t *sheet)
+{
+	issue_day(sheet);
+}
@@ -0,0 +1,52 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHEET_H_
+#define SHEET_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ultraeasy.h"
+
+/**
+ * Day by hour pivot of a run of readings (the layout of ue-db2sheet).
+ *
+ * There is one CSV row per day with a column for each hour of the day and a
+ * final column for any readings that did not get an hour to themselves.
+ * A row is written as soon as a reading from a different day arrives so
+ * only the current day is held in memory. Readings from the same day must
+ * therefore arrive together (as they do from the meter, newest first, or
+ * from an archive, oldest first).
+ */
+typedef struct sheet {
+	FILE *f;
+
+	bool have_day;
+	int year, month, day;
+
+	char hours[24][16];
+	char *additional;
+	size_t additional_len;
+} sheet_t;
+
+void sheet_begin(sheet_t *sheet, FILE *f);
+void sheet_add(sheet_t *sheet, const ultraeasy_record_t *reading);
+void sheet_end(sheet_t *sheet);
+
+#endif /* SHEET_H_ */
@@ -0,0 +1,77 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "show.h"
+
+void show_raw_reading(FILE *f, const ultraeasy_record_t *reading)
+{
+	fprintf(f, "Raw date 0x%08x   Raw reading 0x%08x\n",
+			reading->raw.date, reading->raw.reading);
+}
+
+void show_reading(FILE *f, const ultraeasy_record_t *reading)
+{
+	struct tm exploded;
+	gmtime_r(&reading->date, &exploded);
+
+	fprintf(f, "%4d-%02d-%02d %02d:%02d:%02d    %4.1f mmol/l\n",
+			exploded.tm_year + 1900, exploded.tm_mon+1, exploded.tm_mday,
+			exploded.tm_hour, exploded.tm_min, exploded.tm_sec,
+			reading->mmol_per_litre);
+}
+
+/**
+ * Show a reading (starting a new section whenever the meter changes).
+ */
+int show_meter_reading(void *ctx, const char *serial, const ultraeasy_record_t *record)
+{
+	show_t *show = ctx;
+
+	if (!show->serial || 0 != strcmp(show->serial, serial)) {
+		if (show->want_sheet && show->serial)
+			sheet_end(&show->sheet);
+		if (show->tagged)
+			printf("Meter serial: %s\n", serial);
+		if (show->want_sheet)
+			sheet_begin(&show->sheet, stdout);
+	}
+	show->serial = serial;
+
+	if (show->want_sheet)
+		sheet_add(&show->sheet, record);
+	else
+		show->fn(stdout, record);
+	return 0;
+}
+
+/**
+ * Finish the output (a sheet always has at least its header row).
+ */
+void show_end(show_t *show)
+{
+	if (!show->want_sheet)
+		return;
+
+	if (!show->serial)
+		sheet_begin(&show->sheet, stdout);
+	sheet_end(&show->sheet);
+}
@@ -0,0 +1,52 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHOW_H_
+#define SHOW_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sheet.h"
+#include "ultraeasy.h"
+
+/**
+ * Display of the readings held in stores and archives (ue-archive and
+ * ue-query).
+ */
+typedef void (*show_reading_t)(FILE *f, const ultraeasy_record_t *reading);
+
+/* state for show_meter_reading() */
+typedef struct show {
+	show_reading_t fn;
+	const char *serial;
+
+	// print "Meter serial:" whenever the meter changes
+	bool tagged;
+
+	// pivot the readings (see sheet.h) instead of using fn
+	bool want_sheet;
+	sheet_t sheet;
+} show_t;
+
+void show_raw_reading(FILE *f, const ultraeasy_record_t *reading);
+void show_reading(FILE *f, const ultraeasy_record_t *reading);
+int show_meter_reading(void *ctx, const char *serial, const ultraeasy_record_t *record);
+void show_end(show_t *show);
+
+#endif /* SHOW_H_ */
@@ -0,0 +1,387 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Meter simulator.
+ *
+ * Creates a pseudo-terminal and runs the facade (see facade.c) behind it so
+ * that the real serial code path (termios, poll() and read()/write()) can be
+ * exercised without a meter. The path of the pseudo-terminal is written to
+ * stdout and the simulator runs until it is killed.
+ *
+ * Usage: ue-sim [OPTION]...
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "facade.h"
+#include "framer.h"
+#include "util.h"
+
+typedef struct {
+	unsigned int latency;    // per byte (us)
+	unsigned int jitter;     // maximum extra per byte (us)
+	unsigned int turnaround; // before the meter starts to reply (ms)
+
+	// fault injection (percentage of meter to PC packets)
+	double drop;
+	double corrupt;
+	double junk;
+
+	// never reply to requests for this record (-1 for none)
+	int bad_record;
+} sim_options_t;
+
+static volatile sig_atomic_t stop;
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+static bool chance(double percent)
+{
+	return percent > 0 && (rng() % 1000000) < (percent * 10000);
+}
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+/**
+ * Send bytes to the PC at the simulated line rate.
+ */
+static int send_bytes(int fd, const sim_options_t *opts, const unsigned char *p, unsigned int len)
+{
+	uint64_t deadline = us_gettime(CLOCK_MONOTONIC);
+
+	for (unsigned int i=0; i<len; ) {
+		unsigned int n = len - i;
+
+		if (opts->latency || opts->jitter) {
+			deadline += opts->latency + (opts->jitter ? rng() % (opts->jitter + 1) : 0);
+			us_sleep_until(CLOCK_MONOTONIC, deadline);
+			n = 1;
+		}
+
+		ssize_t res = write(fd, p + i, n);
+		if (res < 0) {
+			if (EINTR == errno || EAGAIN == errno)
+				continue;
+			return -1;
+		}
+
+		i += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Send a packet to the PC, applying any faults that have been requested.
+ */
+static int send_packet(int fd, const sim_options_t *opts, unsigned char *p)
+{
+	unsigned int len = p[OFFSET_LEN];
+
+	if (chance(opts->drop)) {
+		DEBUG("Dropping packet\n");
+		return 0;
+	}
+
+	if (chance(opts->junk)) {
+		unsigned char junk[4];
+		unsigned int junklen = 1 + rng() % sizeof(junk);
+
+		for (unsigned int i=0; i<junklen; i++)
+			junk[i] = rng();
+
+		DEBUG("Sending %u bytes of junk\n", junklen);
+		if (0 != send_bytes(fd, opts, junk, junklen))
+			return -1;
+	}
+
+	if (chance(opts->corrupt)) {
+		DEBUG("Corrupting packet\n");
+		p[rng() % len] ^= 1 + (rng() % 255);
+	}
+
+	return send_bytes(fd, opts, p, len);
+}
+
+/**
+ * Check whether a packet from the PC requests the record we never reply to.
+ */
+static bool is_bad_record(const sim_options_t *opts, const unsigned char *p)
+{
+	const unsigned char *msg = p + OFFSET_MSG;
+
+	return opts->bad_record >= 0 && LEN_MIN + 4 == p[OFFSET_LEN] &&
+	       0x05 == msg[0] && 0x1f == msg[1] &&
+	       opts->bad_record == (msg[2] | (msg[3] << 8));
+}
+
+static int run(int fd, facade_t *facade, const sim_options_t *opts)
+{
+	framer_t rx = { .len = 0 };
+	unsigned char packet[LEN_MAX];
+	struct pollfd pollee = { .fd = fd, .events = POLLIN };
+
+	while (!stop) {
+		int res = poll(&pollee, 1, -1);
+		if (res < 0) {
+			if (EINTR == errno)
+				continue;
+			return -1;
+		}
+
+		res = read(fd, rx.buf + rx.len, framer_space(&rx));
+		if (res < 0) {
+			if (EINTR == errno || EAGAIN == errno)
+				continue;
+			// EIO means nobody has the terminal open
+			if (EIO == errno) {
+				poll(NULL, 0, 10);
+				continue;
+			}
+			return -1;
+		}
+		rx.len += res;
+
+		while ((res = framer_extract(&rx, packet)) > 0) {
+			bool bad_record = is_bad_record(opts, packet);
+			facade_tx_packet(facade, packet, res);
+
+			if (opts->turnaround)
+				ms_sleep_until(CLOCK_MONOTONIC, ms_gettime(CLOCK_MONOTONIC) + opts->turnaround);
+
+			while (0 == facade_rx_packet(facade, packet, sizeof(packet))) {
+				// the record is acknowledged but the reply never comes
+				if (bad_record && packet[OFFSET_LEN] > LEN_MIN) {
+					DEBUG("Not replying to bad record\n");
+					continue;
+				}
+
+				if (0 != send_packet(fd, opts, packet))
+					return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Open a pseudo-terminal and return the master side.
+ *
+ * The slave side is held open (as *slave) so the terminal survives clients
+ * connecting and disconnecting.
+ */
+static int open_pty(int *slave, char **name)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || 0 != grantpt(master) || 0 != unlockpt(master))
+		return -1;
+
+	char *pts = ptsname(master);
+	if (!pts)
+		return -1;
+
+	*slave = open(pts, O_RDWR | O_NOCTTY);
+	if (*slave < 0)
+		return -1;
+
+	// the meter talks raw binary
+	struct termios options;
+	if (0 == tcgetattr(*slave, &options)) {
+		options.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+		options.c_oflag &= ~OPOST;
+		options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+		options.c_cflag &= ~(CSIZE | PARENB);
+		options.c_cflag |= CS8;
+		(void) tcsetattr(*slave, TCSANOW, &options);
+	}
+
+	*name = xstrdup(pts);
+	return master;
+}
+
+const char usage_text[] = "Usage: ue-sim [OPTION]...\n";
+
+static void show_help()
+{
+	printf(usage_text);
+
+	printf(
+"Simulate a OneTouch UltraEasy meter on a pseudo-terminal.\n"
+"\n"
+"  -b, --bad-record=N         acknowledge but never reply to requests for\n"
+"                             record N\n"
+"  -c, --corrupt=PERCENT      corrupt a byte in this percentage of packets\n"
+"  -d, --drop=PERCENT         drop this percentage of packets\n"
+"  -h, --help                 show this help text and exit\n"
+"  -J, --jitter=US            add up to US microseconds to each byte\n"
+"  -j, --junk=PERCENT         send junk ahead of this percentage of packets\n"
+"  -L, --link=PATH            make PATH a symbolic link to the terminal\n"
+"  -l, --latency=US           send one byte every US microseconds\n"
+"                             (default: send packets all at once)\n"
+"  -n, --records=N            number of records held by the meter\n"
+"  -S, --seed=N               seed for the fault injection\n"
+"  -t, --turnaround=MS        wait MS milliseconds before replying\n"
+"                             (default: 10)\n"
+"  -V, --verbose              increase the level of internal logging\n"
+"\n"
+"The path of the terminal is written to stdout.\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	sim_options_t opts = { .turnaround = 10, .bad_record = -1 };
+	char *facade_options = NULL;
+	const char *link_path = NULL;
+	int c;
+
+	static struct option long_options[] = {
+		{ "bad-record", 1, 0, 'b' },
+		{ "corrupt", 1, 0, 'c' },
+		{ "drop", 1, 0, 'd' },
+		{ "help", 0, 0, 'h' },
+		{ "jitter", 1, 0, 'J' },
+		{ "junk", 1, 0, 'j' },
+		{ "link", 1, 0, 'L' },
+		{ "latency", 1, 0, 'l' },
+		{ "records", 1, 0, 'n' },
+		{ "seed", 1, 0, 'S' },
+		{ "turnaround", 1, 0, 't' },
+		{ "verbose", 0, 0, 'V' },
+		{0, 0, 0,  0 }
+	};
+
+	while (-1 != (c = getopt_long(argc, argv, "b:c:d:hJ:j:L:l:n:S:t:V", long_options, NULL))) {
+		switch (c) {
+		case 'b': // --bad-record
+			opts.bad_record = strtol(optarg, NULL, 0);
+			break;
+		case 'c': // --corrupt
+			opts.corrupt = strtod(optarg, NULL);
+			break;
+		case 'd': // --drop
+			opts.drop = strtod(optarg, NULL);
+			break;
+		case 'h': // --help
+			show_help();
+			return 0;
+		case 'J': // --jitter
+			opts.jitter = strtoul(optarg, NULL, 0);
+			break;
+		case 'j': // --junk
+			opts.junk = strtod(optarg, NULL);
+			break;
+		case 'L': // --link
+			link_path = optarg;
+			break;
+		case 'l': // --latency
+			opts.latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'n': // --records
+			free(facade_options);
+			facade_options = xstrdup_printf("records=%s", optarg);
+			break;
+		case 'S': // --seed
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 't': // --turnaround
+			opts.turnaround = strtoul(optarg, NULL, 0);
+			break;
+		case 'V': // --verbose
+			trace_level++;
+			break;
+		default:
+			fprintf(stderr, usage_text);
+			fprintf(stderr, "Try '--help'.\n");
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, usage_text);
+		fprintf(stderr, "Try '--help'.\n");
+		return 1;
+	}
+
+	facade_t *facade = facade_open(facade_options);
+	if (!facade)
+		return 1;
+
+	int slave;
+	char *name;
+	int master = open_pty(&slave, &name);
+	if (master < 0) {
+		fprintf(stderr, "Cannot create pseudo-terminal: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (link_path) {
+		(void) unlink(link_path);
+		if (0 != symlink(name, link_path)) {
+			fprintf(stderr, "Cannot create %s: %s\n", link_path, strerror(errno));
+			return 1;
+		}
+	}
+
+	struct sigaction sa = { .sa_handler = handle_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	int res = run(master, facade, &opts);
+	if (res < 0)
+		fprintf(stderr, "Cannot simulate meter: %s\n", strerror(errno));
+
+	if (link_path)
+		(void) unlink(link_path);
+	facade_close(facade);
+	close(slave);
+	close(master);
+	free(name);
+	free(facade_options);
+
+	return (res < 0 ? 1 : 0);
+}
@@ -0,0 +1,182 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "state.h"
+#include "util.h"
+
+/**
+ * Generate the name of the state file for a meter (creating the state
+ * directory if required).
+ *
+ * Any characters in the serial number that are not alphanumeric are
+ * replaced so that a corrupt serial number cannot escape the directory.
+ */
+char *state_path(const char *dir, const char *serial)
+{
+	int res = mkdir(dir, 0700);
+	if (0 != res && EEXIST != errno) {
+		ERROR("Cannot create state directory %s (%s)\n", dir, strerror(errno));
+		return NULL;
+	}
+
+	char *path = xstrdup_printf("%s/%s", dir, serial);
+	for (char *p = path + strlen(dir) + 1; *p; p++)
+		if (!isalnum((unsigned char) *p))
+			*p = '_';
+
+	return path;
+}
+
+/**
+ * Read the state file for a meter.
+ *
+ * Returns -1 (and sets errno to ENOENT) if the meter has never been seen
+ * before. Unknown keys are ignored so that newer versions of the file
+ * can be read.
+ */
+int state_load(const char *path, meter_state_t *state)
+{
+	char *line = NULL;
+	size_t len = 0;
+	char key[32];
+	int offset;
+
+	memset(state, 0, sizeof(*state));
+
+	FILE *f = fopen(path, "r");
+	if (NULL == f)
+		return -1;
+
+	while (-1 != getline(&line, &len, f)) {
+		if (1 != sscanf(line, "%31s%n", key, &offset))
+			continue;
+
+		char *args = line + offset;
+
+		if (0 == strcmp(key, "records")) {
+			if (1 != sscanf(args, "%u", &state->num_records))
+				goto handle_error;
+		} else if (0 == strcmp(key, "newest")) {
+			if (2 != sscanf(args, "%" SCNx32 " %" SCNx32,
+					&state->newest_date, &state->newest_reading))
+				goto handle_error;
+			state->have_newest = true;
+		} else if (0 == strcmp(key, "partial")) {
+			if (3 != sscanf(args, "%u %" SCNx32 " %" SCNx32, &state->partial_records,
+					&state->partial_date, &state->partial_reading))
+				goto handle_error;
+			state->have_partial = true;
+		} else if (0 == strcmp(key, "next")) {
+			if (1 != sscanf(args, "%u", &state->next_record))
+				goto handle_error;
+		} else if (0 == strcmp(key, "failed")) {
+			unsigned int record;
+			while (1 == sscanf(args, "%u%n", &record, &offset)) {
+				state_add_failed(state, record);
+				args += offset;
+			}
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+
+    handle_error:
+	ERROR("State file %s is corrupt\n", path);
+	free(line);
+	fclose(f);
+	state_free(state);
+	memset(state, 0, sizeof(*state));
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Write the state file for a meter.
+ *
+ * The file is written under a temporary name and then renamed into place
+ * so that a crash cannot leave a partially written state file behind.
+ */
+int state_save(const char *path, const meter_state_t *state)
+{
+	char *tmp = xstrdup_printf("%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (NULL == f)
+		goto handle_error;
+
+	fprintf(f, "records %u\n", state->num_records);
+	if (state->have_newest)
+		fprintf(f, "newest %08" PRIx32 " %08" PRIx32 "\n",
+				state->newest_date, state->newest_reading);
+
+	if (state->have_partial) {
+		fprintf(f, "partial %u %08" PRIx32 " %08" PRIx32 "\n", state->partial_records,
+				state->partial_date, state->partial_reading);
+		fprintf(f, "next %u\n", state->next_record);
+		if (state->num_failed) {
+			fprintf(f, "failed");
+			for (int i=0; i<state->num_failed; i++)
+				fprintf(f, " %u", state->failed[i]);
+			fprintf(f, "\n");
+		}
+	}
+
+	if (0 != fclose(f))
+		goto handle_error;
+
+	if (0 != rename(tmp, path))
+		goto handle_error;
+
+	free(tmp);
+	return 0;
+
+    handle_error:
+	ERROR("Cannot write state file %s (%s)\n", path, strerror(errno));
+	(void) unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/**
+ * Add a record to the list of records that could not be downloaded.
+ */
+void state_add_failed(meter_state_t *state, unsigned int record)
+{
+	state->failed = xrealloc(state->failed, (state->num_failed + 1) * sizeof(unsigned int));
+	state->failed[state->num_failed++] = record;
+}
+
+void state_free(meter_state_t *state)
+{
+	free(state->failed);
+	state->failed = NULL;
+	state->num_failed = 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATE_H_
+#define STATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Persistent per-meter synchronization state.
+ *
+ * This records the newest reading seen during the last successful download
+ * from each meter (a high-water mark) so that later downloads can stop as
+ * soon as they reach a reading that has already been seen.
+ *
+ * It also records a checkpoint for any download that did not complete. The
+ * checkpoint is only valid if the meter still has the same number of
+ * records and the same newest record (otherwise the record indices will
+ * have changed).
+ */
+typedef struct meter_state {
+	unsigned int num_records;
+
+	bool have_newest;
+	uint32_t newest_date;
+	uint32_t newest_reading;
+
+	bool have_partial;
+	unsigned int partial_records;
+	uint32_t partial_date;
+	uint32_t partial_reading;
+	unsigned int next_record;
+	unsigned int num_failed;
+	unsigned int *failed;
+} meter_state_t;
+
+char *state_path(const char *dir, const char *serial);
+int state_load(const char *path, meter_state_t *state);
+int state_save(const char *path, const meter_state_t *state);
+void state_add_failed(meter_state_t *state, unsigned int record);
+void state_free(meter_state_t *state);
+
+#endif /* STATE_H_ */
@@ -0,0 +1,567 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading stores.
+ *
+ * The file starts with an 8 byte header ("UESTO", a NUL, the format version
+ * and another NUL) followed by a series of transactions. Each transaction
+ * is a run of entries ended by a commit entry:
+ *
+ *   'M' serial length (1 byte) serial      - introduce a meter
+ *   'R' meter (2 bytes) date (4 bytes)     - a reading (the raw values from
+ *       reading (4 bytes)                    the meter)
+ *   'C' entries (4 bytes) crc (2 bytes)    - commit
+ *
+ * Meters are numbered in the order they are introduced. All values are
+ * little endian. The commit entry holds the number of entries in the
+ * transaction and the CRC of their bytes so a transaction that was only
+ * partly written (or partly reached the disk) before a crash is recognised
+ * and discarded when the store is next opened. Damage to any earlier
+ * transaction makes the open fail instead (discarding it would also discard
+ * every transaction committed after it).
+ *
+ * Every reading is also kept in memory, together with a hash index, so that
+ * adding a reading costs the same however big the store is.
+ */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "ultraeasy.h"
+#include "util.h"
+
+#define STORE_VERSION 1
+
+static const unsigned char header[8] = { 'U', 'E', 'S', 'T', 'O', 0, STORE_VERSION, 0 };
+
+#define ENTRY_METER	'M'
+#define ENTRY_READING	'R'
+#define ENTRY_COMMIT	'C'
+
+#define READING_LEN 11
+#define COMMIT_LEN 7
+
+/* meters are numbered with 16 bits and the serial length is a single byte */
+#define MAX_METERS 0xffff
+#define MAX_SERIAL_LEN 0xff
+
+typedef struct stored_reading {
+	uint16_t meter;
+	uint32_t date;
+	uint32_t reading;
+} stored_reading_t;
+
+struct ultraeasy_store {
+	int fd;
+	char *pathname;
+	pthread_mutex_t lock;
+
+	// size of the file (everything up to here has been committed)
+	off_t size;
+
+	char **meters;
+	unsigned int num_meters;
+	unsigned int max_meters;
+	unsigned int committed_meters;
+	unsigned int last_meter;	// the most recently used meter (a lookup cache)
+
+	stored_reading_t *readings;
+	unsigned long num_readings;
+	unsigned long max_readings;
+	unsigned long committed_readings;
+
+	// open addressed hash table of reading numbers plus one (zero is empty)
+	unsigned long *index;
+	unsigned long index_size;
+};
+
+static unsigned long hash_reading(const stored_reading_t *r)
+{
+	uint64_t h = ((uint64_t) r->date << 32) ^ r->reading ^ ((uint64_t) r->meter << 16);
+
+	// finalizer from MurmurHash3
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static bool same_reading(const stored_reading_t *a, const stored_reading_t *b)
+{
+	return a->meter == b->meter && a->date == b->date && a->reading == b->reading;
+}
+
+/**
+ * Find the index slot for a reading.
+ *
+ * The slot is either empty or holds an identical reading.
+ */
+static unsigned long *index_lookup(ultraeasy_store_t *store, const stored_reading_t *r)
+{
+	unsigned long mask = store->index_size - 1;
+	unsigned long i = hash_reading(r) & mask;
+
+	while (store->index[i] && !same_reading(&store->readings[store->index[i] - 1], r))
+		i = (i + 1) & mask;
+
+	return &store->index[i];
+}
+
+static void index_grow(ultraeasy_store_t *store)
+{
+	free(store->index);
+	store->index_size = store->index_size ? 2 * store->index_size : 1024;
+	store->index = xzalloc(store->index_size * sizeof(unsigned long));
+
+	for (unsigned long i=0; i<store->num_readings; i++)
+		*index_lookup(store, &store->readings[i]) = i + 1;
+}
+
+/**
+ * Add a reading to the in-memory copy of the store.
+ *
+ * Returns false if the store already holds the reading.
+ */
+static bool insert_reading(ultraeasy_store_t *store, const stored_reading_t *r)
+{
+	// keep the load factor below one half
+	if (2 * (store->num_readings + 1) > store->index_size)
+		index_grow(store);
+
+	unsigned long *slot = index_lookup(store, r);
+	if (*slot)
+		return false;
+
+	if (store->num_readings == store->max_readings) {
+		store->max_readings = store->max_readings ? 2 * store->max_readings : 1024;
+		store->readings = xrealloc(store->readings,
+					   store->max_readings * sizeof(stored_reading_t));
+	}
+
+	store->readings[store->num_readings++] = *r;
+	*slot = store->num_readings;
+	return true;
+}
+
+static void insert_meter(ultraeasy_store_t *store, const char *serial)
+{
+	if (store->num_meters == store->max_meters) {
+		store->max_meters = store->max_meters ? 2 * store->max_meters : 8;
+		store->meters = xrealloc(store->meters, store->max_meters * sizeof(char *));
+	}
+
+	store->meters[store->num_meters++] = xstrdup(serial);
+}
+
+/**
+ * Forget everything added since the last commit.
+ */
+static void rollback(ultraeasy_store_t *store)
+{
+	while (store->num_meters > store->committed_meters)
+		free(store->meters[--store->num_meters]);
+	store->last_meter = 0;
+
+	if (store->num_readings != store->committed_readings) {
+		store->num_readings = store->committed_readings;
+		memset(store->index, 0, store->index_size * sizeof(unsigned long));
+		for (unsigned long i=0; i<store->num_readings; i++)
+			*index_lookup(store, &store->readings[i]) = i + 1;
+	}
+}
+
+/**
+ * Check whether the rest of the file is zeros (the file grew but the data
+ * written into it never reached the disk).
+ */
+static bool only_zeros(FILE *f)
+{
+	int c;
+
+	while (EOF != (c = getc(f)))
+		if (0 != c)
+			return false;
+	return true;
+}
+
+/**
+ * Read the transactions from the store.
+ *
+ * The last transaction is discarded (and the file truncated) if it was torn
+ * by a crash: an entry runs past the end of the file, there is no commit or
+ * the commit (or the zeros left where the data should be) ends the file.
+ * Damage anywhere else means the store is corrupt and it is left alone.
+ */
+static int load(ultraeasy_store_t *store)
+{
+	// big enough for a meter entry (type, length and serial) plus a NUL
+	unsigned char buf[2 + MAX_SERIAL_LEN + 1];
+	uint16_t crc = CRC_CCITT_INITIAL;
+	uint32_t entries = 0;
+	bool corrupt = false;
+	int type;
+
+	int fd = dup(store->fd);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "rb");
+	if (NULL == f) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (1 != fread(buf, sizeof(header), 1, f) || 0 != memcmp(buf, header, sizeof(header))) {
+		ERROR("%s is not a reading store\n", store->pathname);
+		fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+	store->size = sizeof(header);
+
+	while (EOF != (type = getc(f))) {
+		buf[0] = type;
+
+		if (ENTRY_METER == type) {
+			int len = getc(f);
+			if (EOF == len || len != fread(buf + 2, 1, len, f))
+				break;
+			buf[1] = len;
+			buf[len + 2] = '\0';
+			if (store->num_meters >= MAX_METERS) {
+				corrupt = true;
+				break;
+			}
+			insert_meter(store, (char *) buf + 2);
+			crc = crc_ccitt(crc, buf, len + 2);
+			entries++;
+		} else if (ENTRY_READING == type) {
+			if (1 != fread(buf + 1, READING_LEN - 1, 1, f))
+				break;
+			stored_reading_t r = {
+				.meter = get_u16(buf + 1),
+				.date = get_u32(buf + 3),
+				.reading = get_u32(buf + 7),
+			};
+			if (r.meter >= store->num_meters) {
+				corrupt = true;
+				break;
+			}
+			(void) insert_reading(store, &r);
+			crc = crc_ccitt(crc, buf, READING_LEN);
+			entries++;
+		} else if (ENTRY_COMMIT == type) {
+			if (1 != fread(buf + 1, COMMIT_LEN - 1, 1, f))
+				break;
+			if (get_u32(buf + 1) != entries || get_u16(buf + 5) != crc) {
+				corrupt = EOF != getc(f);
+				break;
+			}
+
+			store->size = ftello(f);
+			store->committed_meters = store->num_meters;
+			store->committed_readings = store->num_readings;
+			crc = CRC_CCITT_INITIAL;
+			entries = 0;
+		} else {
+			corrupt = 0 != type || !only_zeros(f);
+			break;
+		}
+	}
+
+	bool failed = ferror(f);
+	fclose(f);
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+	if (corrupt) {
+		ERROR("%s is corrupt (after the transaction ending at byte %lld)\n",
+				store->pathname, (long long) store->size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	rollback(store);
+
+	struct stat st;
+	if (0 != fstat(store->fd, &st))
+		return -1;
+	if (st.st_size != store->size) {
+		TRACE("Discarding %lld bytes from incomplete transaction in %s\n",
+				(long long) (st.st_size - store->size), store->pathname);
+		if (0 != ftruncate(store->fd, store->size))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Open a store (creating it if it does not exist).
+ */
+ultraeasy_store_t *ultraeasy_store_open(const char *pathname)
+{
+	int fd = open(pathname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+
+	if (0 != flock(fd, LOCK_EX | LOCK_NB)) {
+		if (EWOULDBLOCK == errno)
+			ERROR("%s is in use by another process\n", pathname);
+		close(fd);
+		return NULL;
+	}
+
+	ultraeasy_store_t *store = xzalloc(sizeof(ultraeasy_store_t));
+	store->fd = fd;
+	store->pathname = xstrdup(pathname);
+	pthread_mutex_init(&store->lock, NULL);
+	index_grow(store);
+
+	struct stat st;
+	if (0 != fstat(fd, &st))
+		goto handle_error;
+
+	// a new store (or one whose header never reached the disk)
+	if (st.st_size < sizeof(header)) {
+		unsigned char buf[sizeof(header)];
+		if (st.st_size != pread(fd, buf, st.st_size, 0))
+			goto handle_error;
+		if (0 != memcmp(buf, header, st.st_size)) {
+			ERROR("%s is not a reading store\n", pathname);
+			errno = EINVAL;
+			goto handle_error;
+		}
+
+		if (sizeof(header) != pwrite(fd, header, sizeof(header), 0) ||
+		    0 != ftruncate(fd, sizeof(header)) || 0 != fsync(fd))
+			goto handle_error;
+		store->size = sizeof(header);
+		return store;
+	}
+
+	if (0 != load(store))
+		goto handle_error;
+
+	DEBUG("Loaded %lu readings from %u meters\n", store->num_readings, store->num_meters);
+	return store;
+
+    handle_error:
+	{
+		int error = errno;
+		(void) ultraeasy_store_close(store);
+		errno = error;
+	}
+	return NULL;
+}
+
+static int find_meter(ultraeasy_store_t *store, const char *serial)
+{
+	if (store->last_meter < store->num_meters &&
+	    0 == strcmp(store->meters[store->last_meter], serial))
+		return store->last_meter;
+
+	for (unsigned int i=0; i<store->num_meters; i++) {
+		if (0 == strcmp(store->meters[i], serial)) {
+			store->last_meter = i;
+			return i;
+		}
+	}
+
+	if (strlen(serial) > MAX_SERIAL_LEN || store->num_meters >= MAX_METERS) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	insert_meter(store, serial);
+	store->last_meter = store->num_meters - 1;
+	return store->last_meter;
+}
+
+/**
+ * Add a reading to the store (see ultraeasy_store_commit()).
+ *
+ * Returns 1 if the reading is new, 0 if it is already in the store and -1
+ * on error.
+ */
+int ultraeasy_store_add(ultraeasy_store_t *store, const char *serial,
+			const ultraeasy_record_t *record)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&store->lock);
+
+	int meter = find_meter(store, serial);
+	if (meter >= 0) {
+		stored_reading_t r = {
+			.meter = meter,
+			.date = record->raw.date,
+			.reading = record->raw.reading,
+		};
+		res = insert_reading(store, &r);
+	}
+
+	pthread_mutex_unlock(&store->lock);
+	return res;
+}
+
+/**
+ * Make every reading added since the last commit durable.
+ *
+ * The new entries are appended with a single write and flushed to disk.
+ * If anything goes wrong the file is returned to its previous length and
+ * the readings remain pending (so the commit can be retried).
+ */
+int ultraeasy_store_commit(ultraeasy_store_t *store)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&store->lock);
+
+	unsigned int new_meters = store->num_meters - store->committed_meters;
+	unsigned long new_readings = store->num_readings - store->committed_readings;
+	if (0 == new_meters && 0 == new_readings)
+		goto out;
+
+	size_t len = new_readings * READING_LEN + COMMIT_LEN;
+	for (unsigned int i=store->committed_meters; i<store->num_meters; i++)
+		len += 2 + strlen(store->meters[i]);
+
+	unsigned char *buf = xzalloc(len);
+	unsigned char *p = buf;
+
+	for (unsigned int i=store->committed_meters; i<store->num_meters; i++) {
+		size_t n = strlen(store->meters[i]);
+		*p++ = ENTRY_METER;
+		*p++ = n;
+		memcpy(p, store->meters[i], n);
+		p += n;
+	}
+
+	for (unsigned long i=store->committed_readings; i<store->num_readings; i++) {
+		const stored_reading_t *r = &store->readings[i];
+		p[0] = ENTRY_READING;
+		put_u16(p + 1, r->meter);
+		put_u32(p + 3, r->date);
+		put_u32(p + 7, r->reading);
+		p += READING_LEN;
+	}
+
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, buf, p - buf);
+	p[0] = ENTRY_COMMIT;
+	put_u32(p + 1, new_meters + new_readings);
+	put_u16(p + 5, crc);
+
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pwrite(store->fd, buf + done, len - done, store->size + done);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0) {
+			res = -1;
+			break;
+		}
+		done += n;
+	}
+	free(buf);
+
+	if (0 == res && 0 != fdatasync(store->fd))
+		res = -1;
+
+	if (0 != res) {
+		int error = errno;
+		ERROR("Cannot write to %s (%s)\n", store->pathname, strerror(error));
+		(void) ftruncate(store->fd, store->size);
+		errno = error;
+		goto out;
+	}
+
+	store->size += len;
+	store->committed_meters = store->num_meters;
+	store->committed_readings = store->num_readings;
+
+    out:
+	pthread_mutex_unlock(&store->lock);
+	return res;
+}
+
+/**
+ * Count the readings in the store (including any that are not committed).
+ */
+unsigned long ultraeasy_store_count(ultraeasy_store_t *store)
+{
+	pthread_mutex_lock(&store->lock);
+	unsigned long count = store->num_readings;
+	pthread_mutex_unlock(&store->lock);
+
+	return count;
+}
+
+/**
+ * Call fn for every reading in the store, in the order they were added.
+ *
+ * fn returns 0 to continue or non-zero to stop early. The store must not
+ * be changed by fn.
+ */
+int ultraeasy_store_foreach(ultraeasy_store_t *store, ultraeasy_store_fn_t fn, void *ctx)
+{
+	ultraeasy_record_t record;
+
+	for (unsigned long i=0; i<store->num_readings; i++) {
+		const stored_reading_t *r = &store->readings[i];
+
+		ultraeasy_record_from_raw(&record, r->date, r->reading);
+		if (0 != fn(ctx, store->meters[r->meter], &record))
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Close the store, discarding any readings that have not been committed.
+ */
+int ultraeasy_store_close(ultraeasy_store_t *store)
+{
+	int res = close(store->fd);
+
+	for (unsigned int i=0; i<store->num_meters; i++)
+		free(store->meters[i]);
+	free(store->meters);
+	free(store->readings);
+	free(store->index);
+	free(store->pathname);
+	pthread_mutex_destroy(&store->lock);
+	free(store);
+
+	return res;
+}
@@ -0,0 +1,111 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tracering.h"
+#include "util.h"
+
+static const char *type_names[] = {
+	[TRACERING_TX] = "PC to meter",
+	[TRACERING_RX] = "Meter to PC",
+	[TRACERING_DISCARD] = "Discarded bytes",
+	[TRACERING_TIMEOUT] = "Timeout",
+	[TRACERING_CORRUPT] = "Corrupt packet",
+	[TRACERING_DUPLICATE] = "Duplicate packet",
+	[TRACERING_RETRANSMIT] = "Retransmit",
+	[TRACERING_RESET] = "Link reset",
+	[TRACERING_FAILED] = "Command failed",
+};
+
+static tracering_entry_t *claim(tracering_t *ring, tracering_type_t type)
+{
+	tracering_entry_t *entry = &ring->entries[ring->next];
+
+	ring->next = (ring->next + 1) % TRACERING_SIZE;
+	if (ring->count < TRACERING_SIZE)
+		ring->count++;
+
+	entry->timestamp = us_gettime(CLOCK_MONOTONIC);
+	entry->type = type;
+	return entry;
+}
+
+/**
+ * Record a frame (truncated to LEN_MAX bytes).
+ */
+void tracering_frame(tracering_t *ring, tracering_type_t type, const unsigned char *p, unsigned int len)
+{
+	tracering_entry_t *entry = claim(ring, type);
+
+	if (len > sizeof(entry->data))
+		len = sizeof(entry->data);
+
+	entry->arg = 0;
+	entry->len = len;
+	memcpy(entry->data, p, len);
+}
+
+/**
+ * Record an event that has no frame attached (arg is event specific).
+ */
+void tracering_event(tracering_t *ring, tracering_type_t type, uint32_t arg)
+{
+	tracering_entry_t *entry = claim(ring, type);
+
+	entry->arg = arg;
+	entry->len = 0;
+}
+
+/**
+ * Format the contents of the ring, oldest entry first.
+ *
+ * Timestamps are shown in seconds relative to the most recent entry.
+ */
+void tracering_dump(const tracering_t *ring, FILE *f)
+{
+	unsigned int first = (ring->next + TRACERING_SIZE - ring->count) % TRACERING_SIZE;
+	uint64_t last = ring->entries[(ring->next + TRACERING_SIZE - 1) % TRACERING_SIZE].timestamp;
+
+	if (0 == ring->count)
+		return;
+
+	fprintf(f, "Last %u link layer events:\n", ring->count);
+
+	for (unsigned int i=0; i<ring->count; i++) {
+		const tracering_entry_t *entry = &ring->entries[(first + i) % TRACERING_SIZE];
+		uint64_t age = last - entry->timestamp;
+
+		fprintf(f, "  -%llu.%06llu %s", (unsigned long long) (age / 1000000),
+			(unsigned long long) (age % 1000000), type_names[entry->type]);
+
+		if (entry->len) {
+			char *hex = xstrdup_hexdump(entry->data, entry->len);
+			fprintf(f, ": %s\n", hex);
+			free(hex);
+		} else if (entry->arg) {
+			fprintf(f, " (%u)\n", (unsigned int) entry->arg);
+		} else {
+			fprintf(f, "\n");
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * Driver for Lifescan OneTouch UltraEasy
+ * Copyright (C) 2011 Daniel Thompson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACERING_H_
+#define TRACERING_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "framer.h"
+
+#define TRACERING_SIZE 64
+
+typedef enum tracering_type {
+	TRACERING_TX,
+	TRACERING_RX,
+	TRACERING_DISCARD,
+	TRACERING_TIMEOUT,
+	TRACERING_CORRUPT,
+	TRACERING_DUPLICATE,
+	TRACERING_RETRANSMIT,
+	TRACERING_RESET,
+	TRACERING_FAILED,
+} tracering_type_t;
+
+typedef struct tracering_entry {
+	uint64_t timestamp; // CLOCK_MONOTONIC in microseconds
+	uint32_t arg;
+	uint8_t type;
+	uint8_t len;
+	uint8_t data[LEN_MAX];
+} tracering_entry_t;
+
+/*
+ * Fixed size record of the most recent link layer traffic.
+ *
+ * Recording copies raw bytes and a timestamp; nothing is allocated or
+ * formatted until the ring is dumped.
+ */
+typedef struct tracering {
+	tracering_entry_t entries[TRACERING_SIZE];
+	unsigned int next;
+	unsigned int count;
+} tracering_t;
+
+void tracering_frame(tracering_t *ring, tracering_type_t type, const unsigned char *p, unsigned int len);
+void tracering_event(tracering_t *ring, tracering_type_t type, uint32_t arg);
+void tracering_dump(const tracering_t *ring, FILE *f);
+
+#endif /* TRACERING_H_ */
@@ -31,50 +31,93 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "crc.h"
 #include "facade.h"
+#include "framer.h"
+#include "probes.h"
+#include "replay.h"
+#include "tracering.h"
 #include "ue_link.h"
 #include "util.h"
 
-#define OFFSET_STX  0
-#define STX 0x02
-
-#define OFFSET_LEN  1
-#define LEN_MIN 6
-#define LEN_MAX (LEN_MIN + LINK_MAX_MSG_LEN)
-
-#define OFFSET_LINK 2
-#define LINK_RESERVED_MASK ((1 << 7) | (1 << 6) | (1 << 5))
-#define LINK_MORE 4
-#define LINK_DISCONNECT 3
-#define LINK_ACKNOWLEDGE 2
-#define LINK_E 1
-#define LINK_S 0
-
-#define OFFSET_MSG  3
-
-#define OFFSET_ETX(p) (p[OFFSET_LEN] - 3)
-#define ETX 0x03
-
-#define OFFSET_CRC_LO(p) (OFFSET_ETX(p) + 1)
-#define OFFSET_CRC_HI(p) (OFFSET_ETX(p) + 2)
-
 #define LINK_DATA_TIMEOUT 10
 #define LINK_PACKET_TIMEOUT 100
+#define LINK_PACKET_TIMEOUT_MIN 20
 #define LINK_LAYER_TIMEOUT 500
 
-// this is an approximation (true value is closer to 800) but I wanted a margin for error
-#define LINK_US_PER_BYTE 1000
+// number of times a frame is retransmitted before falling back to a link reset
+#define LINK_RETRANSMITS 2
+
+/* states of the non-blocking command exchange (see link_command_continue()) */
+typedef enum link_state {
+	LINK_IDLE,
+	LINK_RESET_FLUSH,
+	LINK_RESET_TX,
+	LINK_RESET_ACK,
+	LINK_CMD_TX,
+	LINK_CMD_ACK,
+	LINK_CMD_REPLY,
+	LINK_PC_ACK,
+	LINK_CMD_RETX,
+	LINK_ACK_RETX,
+} link_state_t;
 
 struct link {
 	int fd;
 	uint64_t last_packet;
 
-	bool use_facade;
+	// in-memory transports (used instead of fd)
+	facade_t *facade;
+	replay_t *replay;
+
+	// skip the guard period (when replaying as fast as possible)
+	bool fast;
+
+	capture_t *capture;
+
+	// timeline profile (may be NULL) and our track within it
+	profile_t *profile;
+	unsigned int track;
+
+	// adaptive guard period (see update_guard())
+	bool adaptive_guard;
+	unsigned int guard;
+	unsigned int turnaround8;
+	uint64_t tx_complete;
 
 	bool e;
 	bool s;
 
 	unsigned char packet_buffer[64];
+
+	// the last frame we sent and (separately) the last ACK we sent, both of
+	// which may need to be retransmitted
+	unsigned char tx_buffer[64];
+	unsigned char ack_buffer[64];
+	bool have_ack;
+
+	framer_t rx;
+
+	// post-mortem record of the most recent traffic
+	tracering_t ring;
+
+	link_stats_t stats;
+
+	// state of the current non-blocking command (if any)
+	struct {
+		link_state_t state;
+		link_cmd_t input;
+		link_msg_t output;
+		uint64_t deadline;
+		uint64_t rx_wait;
+		uint64_t rx_start;
+		unsigned int commands;
+		unsigned int resets;
+		unsigned int retransmits;
+		unsigned int duplicates;
+		link_state_t resume;
+	} async;
 };
 
 typedef struct link_meta {
@@ -84,29 +127,83 @@ typedef struct link_meta {
 	bool s;
 } link_meta_t;
 
-const uint16_t INITIAL_CRC = 0xffff;
+/**
+ * Recalculate the guard period from the meter's measured turnaround.
+ *
+ * The turnaround is the time between the end of our transmission and the
+ * start of the meter's reply. It is smoothed in the same manner as a TCP
+ * round trip estimate (and, likewise, is stored scaled by eight). The guard
+ * period is twice the smoothed turnaround but is never allowed to fall below
+ * a safe floor.
+ */
+static void update_guard(link_t *link, uint64_t now)
+{
+	if (0 == link->tx_complete)
+		return;
+
+	int64_t sample = now - link->tx_complete;
+	if (sample < 0)
+		sample = 0;
+	link->tx_complete = 0;
+
+	link->turnaround8 += sample - (link->turnaround8 >> 3);
+
+	if (!link->adaptive_guard)
+		return;
+
+	unsigned int guard = link->turnaround8 >> 2;
+	if (guard < LINK_PACKET_TIMEOUT_MIN)
+		guard = LINK_PACKET_TIMEOUT_MIN;
+	if (guard > LINK_PACKET_TIMEOUT)
+		guard = LINK_PACKET_TIMEOUT;
+
+	if (guard != link->guard)
+		DEBUG("Guard period is now %ums (turnaround %ums)\n", guard, link->turnaround8 >> 3);
+	link->guard = guard;
+}
 
 /**
- * Calculate the CCITT-CRC16 of the supplied frame.
+ * Count a retry (reason describes what was retried).
  */
-static uint16_t calculate_crc(uint16_t initial_crc, const unsigned char *buffer, unsigned int length)
+static void count_retry(link_t *link, const char *reason)
 {
-	uint16_t crc = initial_crc;
-	if (buffer != NULL)
-	{
-		for (unsigned int index = 0; index < length; index++)
-		{
-			crc = (uint16_t)((unsigned char)(crc >> 8) | (uint16_t)(crc << 8));
-			crc ^= buffer [index];
-			crc ^= (unsigned char)(crc & 0xff) >> 4;
-			crc ^= (uint16_t)((uint16_t)(crc << 8) << 4);
-			crc ^= (uint16_t)((uint16_t)((crc & 0xff) << 4) << 1);
-		}
-	}
-	return (crc);
+	link->stats.retries++;
+	PROBE1(retry, reason);
+	profile_instant(link->profile, link->track, reason);
+}
+
+/**
+ * Double the guard period after a timeout or a corrupt packet.
+ *
+ * The smoothed turnaround is raised to match so that the guard period decays
+ * gradually rather than collapsing back to the floor on the next good packet.
+ */
+static void backoff_guard(link_t *link)
+{
+	link->tx_complete = 0;
+
+	if (!link->adaptive_guard || link->guard >= LINK_PACKET_TIMEOUT)
+		return;
+
+	link->guard *= 2;
+	if (link->guard > LINK_PACKET_TIMEOUT)
+		link->guard = LINK_PACKET_TIMEOUT;
+
+	if ((link->turnaround8 >> 2) < link->guard)
+		link->turnaround8 = link->guard << 2;
+
+	DEBUG("Backing off guard period to %ums\n", link->guard);
+}
+
+/**
+ * Report whether the link uses an in-memory transport rather than a device.
+ */
+static bool is_virtual(link_t *link)
+{
+	return link->facade || link->replay;
 }
 
-static void dump_packet(FILE *f, const char *desc, unsigned char *p)
+static void dump_packet(FILE *f, const char *desc, const unsigned char *p)
 {
 	unsigned int len = p[OFFSET_LEN];
 
@@ -123,7 +220,7 @@ static void dump_packet(FILE *f, const char *desc, unsigned char *p)
 }
 
 
-static bool validate_packet(unsigned char *p)
+static bool validate_packet(const unsigned char *p)
 {
 	if (STX != p[OFFSET_STX]) {
 		DEBUG("Bad STX\n");
@@ -147,7 +244,7 @@ static bool validate_packet(unsigned char *p)
 		return false;
 	}
 
-	uint16_t crc = calculate_crc(INITIAL_CRC, p, p[OFFSET_LEN]-2);
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, p, p[OFFSET_LEN]-2);
 	unsigned char crclo = crc & 0xff;
 	unsigned char crchi = (crc >> 8);
 	if (crclo != p[OFFSET_CRC_LO(p)] || crchi != p[OFFSET_CRC_HI(p)]) {
@@ -159,39 +256,53 @@ static bool validate_packet(unsigned char *p)
 }
 
 /**
- * Issue the packet from the link's pack buffer.
+ * Issue a packet (normally from the link's TX buffer).
  */
-static int tx_packet(link_t *link)
+static int tx_packet(link_t *link, const unsigned char *p)
 {
-	unsigned char *p = link->packet_buffer;
 	ssize_t remaining = p[OFFSET_LEN];
 	uint32_t wire_time = ((remaining * LINK_US_PER_BYTE) + 999) / 1000;
 
 	// wait for the guard period to expire
-	while (1) {
-		uint64_t now = ms_gettime(CLOCK_MONOTONIC);
-
-		// the delta must be signed, we account for wire time during the transmit and therefore
-		// it is quite legitimate for the last_packet to be in the future (due to socket buffering)
-		int64_t delta = now - link->last_packet;
-		if (delta >= LINK_PACKET_TIMEOUT)
-			break;
-
-		int timeout = LINK_PACKET_TIMEOUT - delta;
-		DEBUG("TX guard period has not expired. Sleeping for %dms.\n", timeout);
-		int res = poll(NULL, 0, timeout);
+	//
+	// the delta must be signed, we account for wire time during the transmit and therefore
+	// it is quite legitimate for the last_packet to be in the future (due to socket buffering)
+	uint64_t deadline = link->last_packet + link->guard;
+	int64_t delta = deadline - ms_gettime(CLOCK_MONOTONIC);
+	if (delta > 0 && !link->fast) {
+		DEBUG("TX guard period has not expired. Sleeping for %dms.\n", (int) delta);
+		uint64_t sleep_start = us_gettime(CLOCK_MONOTONIC);
+		PROBE1(guard_sleep_start, delta);
+		profile_begin(link->profile, link->track, "guard_sleep");
+		int res = ms_sleep_until(CLOCK_MONOTONIC, deadline);
+		profile_end(link->profile, link->track, "guard_sleep");
+		uint64_t slept = us_gettime(CLOCK_MONOTONIC) - sleep_start;
+		PROBE1(guard_sleep_done, slept);
+		link->stats.guard_sleep_us += slept;
 		if (0 != res) {
 			TRACE("Cannot wait for TX guard period (%s)\n", strerror(errno));
 			return -1;
 		}
 	}
 
-	assert(validate_packet(p));
 	dump_packet(stderr, "PC to meter", p);
-
-	if (link->use_facade) {
-		facade_tx_packet(p, remaining);
+	tracering_frame(&link->ring, TRACERING_TX, p, remaining);
+	link->stats.packets_tx++;
+	link->stats.bytes_tx += remaining;
+	PROBE3(packet_tx, p, remaining, p[OFFSET_LINK]);
+	if (link->capture)
+		capture_frame(link->capture, CAPTURE_TX, p, remaining);
+
+	profile_begin(link->profile, link->track, "tx");
+
+	if (link->facade || link->replay) {
+		if (link->facade)
+			facade_tx_packet(link->facade, p, remaining);
+		else
+			replay_tx_packet(link->replay, p, remaining);
 		link->last_packet = ms_gettime(CLOCK_MONOTONIC);
+		link->tx_complete = link->last_packet;
+		profile_end(link->profile, link->track, "tx");
 		return 0;
 	}
 
@@ -200,109 +311,233 @@ static int tx_packet(link_t *link)
 		int res;
 
 		res = write(link->fd, p, remaining);
-		if (res < 0 && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+		if (res < 0 && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			profile_end(link->profile, link->track, "tx");
 			return -1;
+		}
 
 		if (res > 0)
 			remaining -= res;
 	}
 
 	link->last_packet = ms_gettime(CLOCK_MONOTONIC) + wire_time;
+	link->tx_complete = link->last_packet;
+	profile_end(link->profile, link->track, "tx");
 	return 0;
 }
 
-static int rx_byte(link_t *link, int timeout, unsigned char *cp)
+/**
+ * Read whatever the device driver has available into the receive buffer.
+ *
+ * Blocks until at least one byte has arrived or the absolute deadline
+ * expires. The port is configured with VMIN and VTIME both zero so once
+ * poll() reports data the read() never blocks and returns everything that
+ * has arrived so far in a single system call.
+ */
+static int rx_fill(link_t *link, uint64_t deadline)
 {
 	struct pollfd pollee = { .fd = link->fd, .events = POLLIN };
+	unsigned int space = framer_space(&link->rx);
+	int res;
 
+	assert(space > 0);
 
-	int res = poll(&pollee, 1, timeout);
+	while (1) {
+		int64_t timeout = deadline - ms_gettime(CLOCK_MONOTONIC);
+		if (timeout < 0)
+			timeout = 0;
+
+		res = poll(&pollee, 1, timeout);
+		if (res < 0) {
+			if (EINTR == errno)
+				continue;
+			TRACE("Error handling meter device driver (%s)\n", strerror(errno));
+			return -1;
+		}
 
-	if (res < 0) {
-		TRACE("Error handling meter device driver (%s)\n", strerror(errno));
-		return -1;
+		if (0 == res) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		res = read(link->fd, link->rx.buf + link->rx.len, space);
+		if (res < 0) {
+			if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)
+				continue;
+			TRACE("Error reading from meter device driver (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		if (0 == res) {
+			TRACE("Meter device driver has hung up\n");
+			errno = EIO;
+			return -1;
+		}
+
+		link->rx.len += res;
+		return 0;
 	}
+}
 
-	if (0 == res) {
-		errno = ETIMEDOUT;
-		return -1;
+/**
+ * Keep a record of a received packet.
+ */
+static void rx_record(link_t *link, unsigned int len)
+{
+	const unsigned char *p = link->packet_buffer;
+
+	tracering_frame(&link->ring, TRACERING_RX, p, len);
+	link->stats.packets_rx++;
+	link->stats.bytes_rx += len;
+	PROBE3(packet_rx, p, len, p[OFFSET_LINK]);
+	if (link->capture)
+		capture_frame(link->capture, CAPTURE_RX, p, len);
+}
+
+/**
+ * Extract a complete packet from the receive buffer into the packet buffer.
+ *
+ * Any junk ahead of the packet is discarded (see framer_extract()).
+ *
+ * Returns 1 if a packet was extracted and 0 if more data is required.
+ */
+static int rx_extract(link_t *link)
+{
+	unsigned long discarded = link->rx.discarded;
+	unsigned long rejected = link->rx.rejected;
+
+	int len = framer_extract(&link->rx, link->packet_buffer);
+
+	if (link->rx.rejected != rejected)
+		PROBE1(crc_reject, link->rx.rejected - rejected);
+
+	if (link->rx.discarded != discarded) {
+		DEBUG("Discarded %lu bytes while looking for a packet\n",
+		      link->rx.discarded - discarded);
+		tracering_event(&link->ring, TRACERING_DISCARD, link->rx.discarded - discarded);
 	}
 
-	assert(1 == res);
+	if (0 == len)
+		return 0;
 
-	res = read(link->fd, cp, 1);
-	if (res < 0) {
-		TRACE("Error reading from meter device driver (%s)\n", strerror(errno));
-		return -1;
+	rx_record(link, len);
+
+	if (trace_level >= 2) {
+		char *hex = xstrdup_hexdump(link->packet_buffer, len);
+		DEBUG("Received %d bytes: %s\n", len, hex);
+		free(hex);
 	}
 
-	assert(1 == res);
-	return 0;
+	link->last_packet = ms_gettime(CLOCK_MONOTONIC);
+	return 1;
+}
+
+/**
+ * Calculate the deadline for the rest of a packet to arrive.
+ *
+ * This allows LINK_DATA_TIMEOUT for each byte of the packet (or for the
+ * largest possible packet if the length is not yet known).
+ */
+static uint64_t rx_deadline(link_t *link, uint64_t start)
+{
+	unsigned int len;
+
+	if (!framer_expected_len(&link->rx, &len))
+		len = LEN_MAX;
+
+	return start + (len * LINK_DATA_TIMEOUT);
 }
 
 /**
  * Receive a packet into the link's packet buffer.
+ *
+ * The first byte of the packet must arrive within LINK_LAYER_TIMEOUT. After
+ * that the whole packet must have arrived before a single deadline that
+ * allows LINK_DATA_TIMEOUT for each byte in the packet. Junk that is
+ * discarded by the framer does not extend the wait for the first byte.
+ *
+ * The turnaround sample (see update_guard()) is the time at which the
+ * packet started to arrive and is only taken once a valid packet has been
+ * extracted.
  */
 static int rx_packet(link_t *link)
 {
 	int res;
-	int offset = 0;
-	int remaining = LINK_MAX_MSG_LEN;
-	uint64_t then;
+	uint64_t then, start = 0;
 
-	if (link->use_facade)
-		return facade_rx_packet(link->packet_buffer, sizeof(link->packet_buffer));
-
-	then = ms_gettime(CLOCK_MONOTONIC);
-	res = rx_byte(link, LINK_LAYER_TIMEOUT, link->packet_buffer);
-	if (0 != res) {
-		if (ETIMEDOUT == res)
-			ERROR("Timout waiting for meter (%ums)\n",
-					(unsigned int ) (ms_gettime(CLOCK_MONOTONIC) - then));
-		return -1;
+	if (link->facade) {
+		res = facade_rx_packet(link->facade, link->packet_buffer, sizeof(link->packet_buffer));
+		if (0 == res) {
+			update_guard(link, ms_gettime(CLOCK_MONOTONIC));
+			rx_record(link, link->packet_buffer[OFFSET_LEN]);
+		}
+		return res;
 	}
 
-	if (link->packet_buffer[0] != STX) {
-		ERROR("Received 0x%02x when expecting STX marker\n", link->packet_buffer[0]);
-		errno = ENOLINK;
-		return -1;
+	if (link->replay) {
+		res = replay_rx_packet(link->replay, link->packet_buffer, sizeof(link->packet_buffer),
+				       LINK_LAYER_TIMEOUT);
+		if (res < 0) {
+			if (ETIMEDOUT == errno) {
+				tracering_event(&link->ring, TRACERING_TIMEOUT, 0);
+				link->stats.timeouts++;
+				PROBE1(timeout, 0);
+				profile_instant(link->profile, link->track, "timeout");
+			}
+			return -1;
+		}
+
+		update_guard(link, ms_gettime(CLOCK_MONOTONIC));
+		rx_record(link, res);
+		return 0;
 	}
 
-	for (offset = 1; offset < remaining; offset++) {
-		res = rx_byte(link, LINK_DATA_TIMEOUT, link->packet_buffer + offset);
-		if (0 != res) {
-			if (ETIMEDOUT == res)
-				ERROR("Timeout receiving packet from meter\n");
-			return -1;
+	then = ms_gettime(CLOCK_MONOTONIC);
+	while (0 == rx_extract(link)) {
+		uint64_t deadline = then + LINK_LAYER_TIMEOUT;
+
+		if (0 == link->rx.len) {
+			start = 0;
+		} else {
+			if (!start)
+				start = ms_gettime(CLOCK_MONOTONIC);
+			deadline = rx_deadline(link, start);
 		}
 
-		if (OFFSET_LEN == offset) {
-			if (link->packet_buffer[OFFSET_LEN] > LINK_MAX_MSG_LEN) {
-				ERROR("Received oversized packet");
-				errno = ENOLINK;
-				return -1;
+		res = rx_fill(link, deadline);
+		if (0 == res && !start) {
+			// the whole packet may have arrived in one read
+			start = ms_gettime(CLOCK_MONOTONIC);
+		}
+		if (0 != res) {
+			if (ETIMEDOUT == errno) {
+				tracering_event(&link->ring, TRACERING_TIMEOUT, link->rx.len);
+				link->stats.timeouts++;
+				PROBE1(timeout, link->rx.len);
+				profile_instant(link->profile, link->track, "timeout");
 			}
-
-			remaining = link->packet_buffer[OFFSET_LEN];
+			if (ETIMEDOUT == errno && start)
+				ERROR("Timeout receiving packet from meter\n");
+			else if (ETIMEDOUT == errno)
+				ERROR("Timout waiting for meter (%ums)\n",
+						(unsigned int ) (ms_gettime(CLOCK_MONOTONIC) - then));
+			framer_reset(&link->rx);
+			return -1;
 		}
 	}
 
-	char *hex = xstrdup_hexdump(link->packet_buffer, offset);
-	DEBUG("Received %d bytes: %s\n", offset, hex);
-	free(hex);
-
-	link->last_packet = ms_gettime(CLOCK_MONOTONIC);
+	update_guard(link, start ? start : ms_gettime(CLOCK_MONOTONIC));
 	return 0;
 }
 
 /**
- * Pack the meta-data and message into the link's packet buffer.
+ * Pack the meta-data and message into the link's TX buffer.
  */
 static void pack_packet(link_t *link, link_meta_t meta, const link_msg_t *msg)
 {
 	const link_msg_t default_msg = { 0 };
 
-	unsigned char *p = link->packet_buffer;
+	unsigned char *p = link->tx_buffer;
 	if (!msg)
 		msg = &default_msg;
 
@@ -316,13 +551,16 @@ static void pack_packet(link_t *link, link_meta_t meta, const link_msg_t *msg)
 	memcpy(p + OFFSET_MSG, msg->data, msg->len);
 	p[OFFSET_ETX(p)] = ETX;
 
-	uint16_t crc = calculate_crc(INITIAL_CRC, p, p[OFFSET_LEN]-2);
+	uint16_t crc = crc_ccitt(CRC_CCITT_INITIAL, p, p[OFFSET_LEN]-2);
 	p[OFFSET_CRC_LO(p)] = crc & 0xff;
 	p[OFFSET_CRC_HI(p)] = crc >> 8;
 }
 
 /**
  * Unpack the meta-data and message from the link's packet buffer.
+ *
+ * Returns 1 (and sets errno to EALREADY) if the packet is a retransmission
+ * of a packet we have already received.
  */
 static int unpack_packet(link_t *link, link_meta_t *meta, link_msg_t *msg)
 {
@@ -335,8 +573,12 @@ static int unpack_packet(link_t *link, link_meta_t *meta, link_msg_t *msg)
 	if (p[OFFSET_LEN] <= LEN_MAX)
 		dump_packet(stderr, "Meter to PC", p);
 
-	if (!validate_packet(p)) {
+	bool valid = validate_packet(p);
+	PROBE2(crc_check, p[OFFSET_LEN], valid);
+	if (!valid) {
 		ERROR("Packet received from meter is corrupt\n");
+		tracering_event(&link->ring, TRACERING_CORRUPT, 0);
+		link->stats.crc_failures++;
 		errno = ENOLINK;
 		return -1;
 	}
@@ -347,9 +589,25 @@ static int unpack_packet(link_t *link, link_meta_t *meta, link_msg_t *msg)
 	meta->s = p[OFFSET_LINK] & (1 << LINK_S);
 
 	if (meta->s != link->e) {
-		ERROR("Packet sequence number is incorrect\n");
-		errno = ENOLINK;
-		return -1;
+		if (meta->disconnect) {
+			ERROR("Packet sequence number is incorrect\n");
+			errno = ENOLINK;
+			return -1;
+		}
+
+		DEBUG("Received duplicate packet\n");
+		tracering_event(&link->ring, TRACERING_DUPLICATE, 0);
+		errno = EALREADY;
+		return 1;
+	}
+
+	// an acknowledgement whose E bit matches our (already toggled) S bit
+	// refers to a packet we have already seen acknowledged
+	if (meta->acknowledge && !meta->disconnect && meta->e == link->s) {
+		DEBUG("Received duplicate acknowledgement\n");
+		tracering_event(&link->ring, TRACERING_DUPLICATE, 0);
+		errno = EALREADY;
+		return 1;
 	}
 
 	msg->len = p[OFFSET_LEN] - LEN_MIN;
@@ -370,34 +628,200 @@ static int pack_and_tx(link_t *link, link_meta_t meta, const link_msg_t *msg)
 
 	pack_packet(link, meta, msg);
 
-	res = tx_packet(link);
+	res = tx_packet(link, link->tx_buffer);
 	if (res < 0) {
 		TRACE("Cannot issue reset packet (%s)\n", strerror(errno));
 		return -1;
 	}
 
+	if (meta.acknowledge && !meta.disconnect) {
+		memcpy(link->ack_buffer, link->tx_buffer, sizeof(link->ack_buffer));
+		link->have_ack = true;
+	}
+
 	return 0;
 }
 
-static int rx_and_unpack(link_t *link, link_meta_t *meta, link_msg_t *msg)
+/**
+ * Copy the prepared frame matching the current sequence bits into the
+ * link's TX buffer and issue it.
+ */
+static int tx_command(link_t *link, const link_cmd_t *cmd)
 {
-	int res;
+	const unsigned char *frame = cmd->frames[(link->e << 1) | link->s];
+
+	memcpy(link->tx_buffer, frame, frame[OFFSET_LEN]);
 
-	res = rx_packet(link);
+	int res = tx_packet(link, link->tx_buffer);
 	if (res < 0) {
-		TRACE("Cannot accept reply from meter (%s)\n", strerror(errno));
+		TRACE("Cannot issue command packet (%s)\n", strerror(errno));
 		return -1;
 	}
 
-	res = unpack_packet(link, meta, msg);
+	return 0;
+}
+
+/**
+ * Retransmit the last frame we sent.
+ */
+static int retransmit(link_t *link)
+{
+	TRACE("Retransmitting last packet\n");
+	tracering_event(&link->ring, TRACERING_RETRANSMIT, 0);
+	count_retry(link, "retransmit");
+
+	int res = tx_packet(link, link->tx_buffer);
 	if (res < 0) {
-		TRACE("Bad back from meter (%s)\n", strerror(errno));
+		TRACE("Cannot retransmit packet (%s)\n", strerror(errno));
 		return -1;
 	}
 
 	return 0;
 }
 
+/**
+ * Receive and unpack a packet.
+ *
+ * Duplicate packets are discarded. If the duplicate is a data packet then
+ * the meter did not see our acknowledgement so we send it again.
+ */
+static int rx_and_unpack(link_t *link, link_meta_t *meta, link_msg_t *msg)
+{
+	int res;
+
+	for (int duplicates=0; duplicates<=LINK_RETRANSMITS; duplicates++) {
+		res = rx_packet(link);
+		if (res < 0) {
+			TRACE("Cannot accept reply from meter (%s)\n", strerror(errno));
+			backoff_guard(link);
+			return -1;
+		}
+
+		res = unpack_packet(link, meta, msg);
+		if (res < 0) {
+			TRACE("Bad back from meter (%s)\n", strerror(errno));
+			backoff_guard(link);
+			return -1;
+		}
+
+		if (0 == res)
+			return 0;
+
+		if (!meta->acknowledge && link->have_ack) {
+			TRACE("Meter did not see our acknowledgement. Resending...\n");
+			count_retry(link, "ack");
+			res = tx_packet(link, link->ack_buffer);
+			if (res < 0)
+				return -1;
+		}
+	}
+
+	TRACE("Too many duplicate packets from meter\n");
+	errno = ENOLINK;
+	return -1;
+}
+
+/**
+ * Receive and unpack a packet, retransmitting our last packet if nothing
+ * (or nothing valid) arrives.
+ *
+ * This allows isolated lost or corrupt packets to be recovered without
+ * resetting the link.
+ */
+static int rx_and_unpack_with_retransmit(link_t *link, link_meta_t *meta, link_msg_t *msg)
+{
+	int res;
+
+	for (int retransmits=0; ; retransmits++) {
+		res = rx_and_unpack(link, meta, msg);
+		if (0 == res || retransmits >= LINK_RETRANSMITS)
+			return res;
+
+		res = retransmit(link);
+		if (res < 0)
+			return res;
+	}
+}
+
+/**
+ * Throw away any stale data that is waiting to be received.
+ */
+static int flush_rx(link_t *link)
+{
+	unsigned char flush_buffer[64];
+	int res;
+
+	struct pollfd pollee = { .fd = link->fd, .events = POLLIN };
+	while (1 == (res = poll(&pollee, 1, 0))) {
+		res = read(link->fd, flush_buffer, sizeof(flush_buffer));
+		assert(0 != res); // poll said data was available
+		if (res < 0)
+			break;
+
+		DEBUG("Throwing away %d bytes of junk data\n", res);
+	}
+	if (res < 0)
+		return -1;
+
+	if (link->rx.len)
+		DEBUG("Throwing away %u bytes of buffered data\n", link->rx.len);
+	framer_reset(&link->rx);
+
+	return 0;
+}
+
+/**
+ * Check the meter's reply to a DISCONNECT packet.
+ */
+static int accept_reset_ack(link_t *link, const link_meta_t *acknowledge)
+{
+	if (!acknowledge->acknowledge || !acknowledge->disconnect) {
+		TRACE("No acknowledgement from meter\n");
+		errno = ENOLINK;
+		return 1; // non-fatal
+	}
+
+	return 0;
+}
+
+/**
+ * Check the meter's acknowledgement of a command and update the sequence number.
+ */
+static int accept_ack(link_t *link, const link_meta_t *meter_ack)
+{
+	if (!meter_ack->acknowledge || meter_ack->disconnect) {
+		if (!meter_ack->acknowledge)
+			TRACE("No acknowledgement from meter\n");
+		if (meter_ack->disconnect)
+			TRACE("Meter has requested disconnection\n");
+		errno = ENOLINK;
+		return 1; // non-fatal
+	}
+
+	// update the sequence number (this is triggered by the ACK)
+	link->s = !link->s;
+	return 0;
+}
+
+/**
+ * Check the meter's reply to a command and update the expected sequence number.
+ */
+static int accept_reply(link_t *link, const link_meta_t *meter_reply)
+{
+	if (meter_reply->acknowledge || meter_reply->disconnect) {
+		if (meter_reply->acknowledge)
+			TRACE("Spurious acknowledgement from meter\n");
+		if (meter_reply->disconnect)
+			TRACE("Meter has requested disconnection\n");
+		errno = ENOLINK;
+		return 1; // non-fatal
+	}
+
+	// set the expected sequence number for the next packet
+	link->e = !meter_reply->s;
+	return 0;
+}
+
 int do_reset(link_t *link, bool flush)
 {
 	link_meta_t disconnect = { .disconnect = true };
@@ -405,94 +829,451 @@ int do_reset(link_t *link, bool flush)
 	int res;
 
 	DEBUG("Attempting to link level reset\n");
+	tracering_event(&link->ring, TRACERING_RESET, 0);
+	link->stats.resets++;
+	PROBE1(reset, flush);
 
-	if (flush && !link->use_facade) {
-		unsigned char flush_buffer[64];
-
+	if (flush && !link->facade && !link->fast) {
 		// wait for two guard periods for any stale data to arrive
+		profile_begin(link->profile, link->track, "reset_flush");
 		res = poll(NULL, 0, 2 * LINK_PACKET_TIMEOUT);
+		if (0 == res)
+			res = flush_rx(link);
+		profile_end(link->profile, link->track, "reset_flush");
 		if (0 != res)
 			return -1;
-
-		// clear out any stale data
-		struct pollfd pollee = { .fd = link->fd, .events = POLLIN };
-		while (1 == (res = poll(&pollee, 1, 0))) {
-			res = read(link->fd, flush_buffer, sizeof(flush_buffer));
-			assert(0 != res); // poll said data was available
-			if (res < 0)
-				break;
-
-			DEBUG("Throwing away %d bytes of junk data\n", res);
-		}
-		if (res < 0)
-			return -1;
 	}
 
 	link->e = false;
 	link->s = false;
+	link->have_ack = false;
 
 	res = pack_and_tx(link, disconnect, NULL);
 	if (0 != res)
 		return -1;
 
+	profile_begin(link->profile, link->track, "ack_wait");
 	res = rx_and_unpack(link, &acknowledge, NULL);
+	profile_end(link->profile, link->track, "ack_wait");
 	if (0 != res)
 		return 1; // non-fatal
 
-	if (!acknowledge.acknowledge || !acknowledge.disconnect) {
-		TRACE("No acknowledgement from meter\n");
-		errno = ENOLINK;
-		return 1; // non-fatal
-	}
-
-	return 0;
+	return accept_reset_ack(link, &acknowledge);
 }
 
-int do_command(link_t *link, link_msg_t *input, link_msg_t *output)
+int do_command(link_t *link, const link_cmd_t *input, link_msg_t *output)
 {
 	int res;
-	link_meta_t pc_cmd = { false };
 	link_meta_t meter_ack;
 	link_meta_t meter_reply;
 	link_meta_t pc_ack = { .acknowledge = true };
 
-	res = pack_and_tx(link, pc_cmd, input);
+	res = tx_command(link, input);
 	if (0 != res)
 		return -1;
 
-	res = rx_and_unpack(link, &meter_ack, NULL);
+	profile_begin(link->profile, link->track, "ack_wait");
+	res = rx_and_unpack_with_retransmit(link, &meter_ack, NULL);
+	profile_end(link->profile, link->track, "ack_wait");
 	if (0 != res)
 		return 1; // non-fatal
 
-	if (!meter_ack.acknowledge || meter_ack.disconnect) {
-		if (!meter_ack.acknowledge)
-			TRACE("No acknowledgement from meter\n");
-		if (meter_ack.disconnect)
-			TRACE("Meter has requested disconnection\n");
-		errno = ENOLINK;
+	res = accept_ack(link, &meter_ack);
+	if (0 != res)
+		return res;
+
+	// if the reply is lost then retransmitting the command (which still
+	// carries the old sequence number) prompts the meter to send it again
+	profile_begin(link->profile, link->track, "reply_wait");
+	res = rx_and_unpack_with_retransmit(link, &meter_reply, output);
+	profile_end(link->profile, link->track, "reply_wait");
+	if (0 != res)
 		return 1; // non-fatal
+
+	res = accept_reply(link, &meter_reply);
+	if (0 != res)
+		return res;
+
+	return pack_and_tx(link, pc_ack, NULL);
+}
+
+static bool async_is_rx(link_state_t state)
+{
+	return LINK_RESET_ACK == state || LINK_CMD_ACK == state || LINK_CMD_REPLY == state;
+}
+
+static bool async_is_tx(link_state_t state)
+{
+	return LINK_RESET_TX == state || LINK_CMD_TX == state || LINK_PC_ACK == state ||
+	       LINK_CMD_RETX == state || LINK_ACK_RETX == state;
+}
+
+static void async_expect_rx(link_t *link, link_state_t state, uint64_t now)
+{
+	link->async.state = state;
+	link->async.rx_wait = now + LINK_LAYER_TIMEOUT;
+	link->async.deadline = link->async.rx_wait;
+	link->async.rx_start = 0;
+}
+
+static void async_start_reset(link_t *link, bool flush, uint64_t now)
+{
+	DEBUG("Attempting to link level reset\n");
+	tracering_event(&link->ring, TRACERING_RESET, 0);
+	link->stats.resets++;
+	PROBE1(reset, flush);
+
+	if (flush && !link->facade && !link->fast) {
+		// wait for two guard periods for any stale data to arrive
+		link->async.state = LINK_RESET_FLUSH;
+		link->async.deadline = now + (2 * LINK_PACKET_TIMEOUT);
+	} else {
+		link->async.state = LINK_RESET_TX;
 	}
+}
 
-	// update the sequence number (this is triggered by the ACK)
-	link->s = !link->s;
+/**
+ * Non-blocking equivalent of rx_and_unpack().
+ *
+ * Returns 0 when a packet has been unpacked, 1 if the packet has not yet
+ * arrived and -1 if the packet timed out or could not be unpacked. The
+ * deadlines and the turnaround sample are the same as rx_packet()'s.
+ *
+ * Duplicate packets are discarded and, if the meter did not see our
+ * acknowledgement, the state is switched to LINK_ACK_RETX to resend it.
+ */
+static int async_rx_and_unpack(link_t *link, uint64_t now, link_meta_t *meta, link_msg_t *msg)
+{
+	int res;
 
-	res = rx_and_unpack(link, &meter_reply, output);
-	if (0 != res)
-		return 1; // non-fatal
+	if (is_virtual(link))
+		return rx_and_unpack(link, meta, msg);
 
-	if (meter_reply.acknowledge || meter_reply.disconnect) {
-		if (meter_reply.acknowledge)
-			TRACE("Spurious acknowledgement from meter\n");
-		if (meter_reply.disconnect)
-			TRACE("Meter has requested disconnection\n");
-		errno = ENOLINK;
-		return 1; // non-fatal
+	// collect whatever has arrived without waiting for any more
+	if (framer_space(&link->rx)) {
+		res = rx_fill(link, 0);
+		if (0 != res && ETIMEDOUT != errno)
+			goto handle_error;
 	}
 
-	// set the expected sequence number for the next packet
-	link->e = !meter_reply.s;
+    again:
+	res = rx_extract(link);
+	if (0 == res) {
+		// if the framer discarded everything then keep waiting for the
+		// first byte (but no longer than we originally intended)
+		if (!link->rx.len)
+			link->async.rx_start = 0;
+		else if (!link->async.rx_start)
+			link->async.rx_start = now;
+
+		if (link->async.rx_start)
+			link->async.deadline = rx_deadline(link, link->async.rx_start);
+		else
+			link->async.deadline = link->async.rx_wait;
+		if (now < link->async.deadline)
+			return 1;
+
+		if (link->async.rx_start)
+			ERROR("Timeout receiving packet from meter\n");
+		else
+			ERROR("Timout waiting for meter (%ums)\n", LINK_LAYER_TIMEOUT);
+		tracering_event(&link->ring, TRACERING_TIMEOUT, link->rx.len);
+		link->stats.timeouts++;
+		PROBE1(timeout, link->rx.len);
+		profile_instant(link->profile, link->track, "timeout");
+		framer_reset(&link->rx);
+		errno = ETIMEDOUT;
+		goto handle_error;
+	}
 
-	return pack_and_tx(link, pc_ack, NULL);
+	update_guard(link, link->async.rx_start ? link->async.rx_start : now);
+
+	res = unpack_packet(link, meta, msg);
+	if (res < 0) {
+		TRACE("Bad back from meter (%s)\n", strerror(errno));
+		backoff_guard(link);
+		return -1;
+	}
+
+	if (res > 0) {
+		if (++link->async.duplicates > LINK_RETRANSMITS) {
+			TRACE("Too many duplicate packets from meter\n");
+			errno = ENOLINK;
+			return -1;
+		}
+
+		if (!meta->acknowledge && link->have_ack) {
+			TRACE("Meter did not see our acknowledgement. Resending...\n");
+			count_retry(link, "ack");
+			link->async.resume = link->async.state;
+			link->async.state = LINK_ACK_RETX;
+			return 1;
+		}
+
+		// wait afresh for the next packet (as rx_and_unpack() does)
+		link->async.rx_start = 0;
+		link->async.rx_wait = now + LINK_LAYER_TIMEOUT;
+		goto again;
+	}
+
+	return 0;
+
+    handle_error:
+	TRACE("Cannot accept reply from meter (%s)\n", strerror(errno));
+	backoff_guard(link);
+	return -1;
+}
+
+/**
+ * Record that the link has given up and show how it got there.
+ */
+static void link_failed(link_t *link)
+{
+	tracering_event(&link->ring, TRACERING_FAILED, 0);
+	tracering_dump(&link->ring, stderr);
+}
+
+/**
+ * Handle a recoverable error during a non-blocking command.
+ *
+ * This applies the same retry policy as link_command() and link_reset():
+ * the command packet is retransmitted a couple of times before we resort
+ * to resetting the link. Like link_command() we reset the link even after
+ * the final attempt so that the next command starts from a known state
+ * (see LINK_RESET_ACK).
+ */
+static int async_recover(link_t *link, uint64_t now)
+{
+	if ((LINK_CMD_ACK == link->async.state || LINK_CMD_REPLY == link->async.state) &&
+	    link->async.retransmits++ < LINK_RETRANSMITS) {
+		link->async.resume = link->async.state;
+		link->async.state = LINK_CMD_RETX;
+		return 0;
+	}
+
+	if (LINK_RESET_FLUSH == link->async.state || LINK_RESET_ACK == link->async.state) {
+		if (++link->async.resets >= 4) {
+			TRACE("Giving up after %d retries\n", link->async.resets);
+			goto handle_error;
+		}
+
+		TRACE("Recoverable error during reset (%s). Retrying...\n", strerror(errno));
+		count_retry(link, "reset");
+		async_start_reset(link, true, now);
+		return 0;
+	}
+
+	link->async.commands++;
+	TRACE("Recoverable error during command processing (%s). Retrying...\n", strerror(errno));
+	count_retry(link, "command");
+	link->async.resets = 0;
+	async_start_reset(link, false, now);
+	return 0;
+
+    handle_error:
+	link->async.state = LINK_IDLE;
+	link_failed(link);
+	errno = ENOLINK;
+	return -1;
+}
+
+int link_get_fd(link_t *link)
+{
+	return link->fd;
+}
+
+/**
+ * Begin a non-blocking command.
+ *
+ * The command is progressed by calling link_command_continue() whenever the
+ * link's file descriptor becomes readable or its deadline is reached.
+ */
+int link_command_start(link_t *link, const link_cmd_t *input)
+{
+	if (LINK_IDLE != link->async.state) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	link->async.input = *input;
+	link->async.commands = 0;
+	link->async.resets = 0;
+	link->async.state = LINK_CMD_TX;
+
+	return 0;
+}
+
+/**
+ * Report whether the current non-blocking command is waiting for input.
+ *
+ * When this is false the file descriptor should not be polled for input
+ * (the command is waiting for a deadline instead).
+ */
+bool link_wants_input(link_t *link)
+{
+	return async_is_rx(link->async.state) && !is_virtual(link);
+}
+
+/**
+ * Get the (CLOCK_MONOTONIC, in milliseconds) time at which
+ * link_command_continue() must next be called if the file descriptor
+ * does not become readable first.
+ *
+ * Returns MS_ERR if there is no command in progress.
+ */
+uint64_t link_get_deadline(link_t *link)
+{
+	link_state_t state = link->async.state;
+
+	if (LINK_IDLE == state)
+		return MS_ERR;
+
+	if (async_is_tx(state))
+		return link->last_packet + link->guard;
+
+	if (async_is_rx(state) && is_virtual(link))
+		return 0;
+
+	return link->async.deadline;
+}
+
+/**
+ * Progress the current non-blocking command as far as possible without
+ * blocking.
+ *
+ * Returns 0 when the command is complete (and the output has been filled in),
+ * 1 if the command is still in progress and -1 if the command has failed.
+ */
+int link_command_continue(link_t *link, link_msg_t *output)
+{
+	link_meta_t disconnect = { .disconnect = true };
+	link_meta_t pc_ack = { .acknowledge = true };
+	link_meta_t meta;
+	int res;
+
+	while (1) {
+		uint64_t now = ms_gettime(CLOCK_MONOTONIC);
+
+		if (async_is_tx(link->async.state) && now < link_get_deadline(link))
+			return 1;
+
+		switch (link->async.state) {
+		case LINK_IDLE:
+			errno = EINVAL;
+			return -1;
+
+		case LINK_RESET_FLUSH:
+			if (now < link->async.deadline)
+				return 1;
+
+			res = flush_rx(link);
+			if (0 != res)
+				goto handle_error;
+
+			link->async.state = LINK_RESET_TX;
+			break;
+
+		case LINK_RESET_TX:
+			link->e = false;
+			link->s = false;
+			link->have_ack = false;
+
+			res = pack_and_tx(link, disconnect, NULL);
+			if (0 != res)
+				goto handle_error;
+
+			async_expect_rx(link, LINK_RESET_ACK, now);
+			break;
+
+		case LINK_RESET_ACK:
+			res = async_rx_and_unpack(link, now, &meta, NULL);
+			if (res > 0)
+				return 1;
+			if (res < 0 || 0 != accept_reset_ack(link, &meta)) {
+				if (0 != async_recover(link, now))
+					return -1;
+				break;
+			}
+
+			if (link->async.commands >= 3) {
+				DEBUG("Giving up after %d retries\n", link->async.commands);
+				link->async.state = LINK_IDLE;
+				link_failed(link);
+				errno = ENOLINK;
+				return -1;
+			}
+
+			link->async.state = LINK_CMD_TX;
+			break;
+
+		case LINK_CMD_TX:
+			res = tx_command(link, &link->async.input);
+			if (0 != res)
+				goto handle_error;
+
+			link->async.retransmits = 0;
+			link->async.duplicates = 0;
+
+			async_expect_rx(link, LINK_CMD_ACK, now);
+			break;
+
+		case LINK_CMD_ACK:
+			res = async_rx_and_unpack(link, now, &meta, NULL);
+			if (res > 0)
+				return 1;
+			if (res < 0 || 0 != accept_ack(link, &meta)) {
+				if (0 != async_recover(link, now))
+					return -1;
+				break;
+			}
+
+			link->async.retransmits = 0;
+			async_expect_rx(link, LINK_CMD_REPLY, now);
+			break;
+
+		case LINK_CMD_REPLY:
+			res = async_rx_and_unpack(link, now, &meta, &link->async.output);
+			if (res > 0)
+				return 1;
+			if (res < 0 || 0 != accept_reply(link, &meta)) {
+				if (0 != async_recover(link, now))
+					return -1;
+				break;
+			}
+
+			link->async.state = LINK_PC_ACK;
+			break;
+
+		case LINK_PC_ACK:
+			res = pack_and_tx(link, pc_ack, NULL);
+			if (0 != res)
+				goto handle_error;
+
+			link->async.state = LINK_IDLE;
+			*output = link->async.output;
+			return 0;
+
+		case LINK_CMD_RETX:
+			res = retransmit(link);
+			if (0 != res)
+				goto handle_error;
+
+			async_expect_rx(link, link->async.resume, now);
+			break;
+
+		case LINK_ACK_RETX:
+			res = tx_packet(link, link->ack_buffer);
+			if (0 != res)
+				goto handle_error;
+
+			async_expect_rx(link, link->async.resume, now);
+			break;
+		}
+	}
+
+    handle_error:
+	link->async.state = LINK_IDLE;
+	return -1;
 }
 
 /**
@@ -521,6 +1302,11 @@ static int configure_termios(link_t *link)
         // local, enable receiver, 8-bit data
         options.c_cflag |= (CLOCAL | CREAD | CS8);
 
+	// read() returns immediately with whatever is available (we use poll() to
+	// wait for data, see rx_fill())
+	options.c_cc[VMIN] = 0;
+	options.c_cc[VTIME] = 0;
+
 	res = tcsetattr(link->fd, TCSANOW, &options);
 	if (0 != res) {
 		ERROR("Cannot configure device parameters (%s)\n", strerror(errno));
@@ -530,14 +1316,52 @@ static int configure_termios(link_t *link)
 	return 0;
 }
 
-link_t *link_open(const char *pathname)
+/**
+ * Open a link to the meter.
+ *
+ * As well as a serial device the pathname can be "facade" (a simulated
+ * meter, see facade.c for the options that can follow "facade:") or
+ * "replay:FILE" (or "replay-fast:FILE") to play back a capture file with
+ * its original timing (or as fast as possible). If capture is not NULL
+ * then all link traffic is recorded to that file. If profile is not NULL
+ * then the link adds a track to the profile.
+ */
+link_t *link_open(const char *pathname, const char *capture, profile_t *profile)
 {
 	link_t *link;
 	int res;
 
 	link = xzalloc(sizeof(link_t));
+	link->fd = -1;
+	link->guard = LINK_PACKET_TIMEOUT;
+	link->turnaround8 = LINK_PACKET_TIMEOUT << 2;
+
+	link->profile = profile;
+	link->track = profile_track(profile, pathname);
+	profile_begin(link->profile, link->track, "link_open");
+
+	if (capture) {
+		link->capture = capture_create(capture);
+		if (!link->capture) {
+			ERROR("Cannot create capture file %s (%s)\n", capture, strerror(errno));
+			goto handle_error;
+		}
+	}
 
-	if (0 != strcmp(pathname, "facade")) {
+	if (0 == strcmp(pathname, "facade") || 0 == strncmp(pathname, "facade:", 7)) {
+		link->facade = facade_open(pathname[6] ? pathname + 7 : NULL);
+		if (!link->facade)
+			goto handle_error;
+	} else if (0 == strncmp(pathname, "replay:", 7)) {
+		link->replay = replay_open(pathname + 7, false);
+		if (!link->replay)
+			goto handle_error;
+	} else if (0 == strncmp(pathname, "replay-fast:", 12)) {
+		link->replay = replay_open(pathname + 12, true);
+		if (!link->replay)
+			goto handle_error;
+		link->fast = true;
+	} else {
 		link->fd = open(pathname, O_RDWR);
 		if (link->fd < 0)
 			goto handle_error;
@@ -545,18 +1369,17 @@ link_t *link_open(const char *pathname)
 		res = configure_termios(link);
 		if (0 != res)
 			goto handle_error;
-	} else {
-		link->fd = -1;
-		link->use_facade = true;
 	}
 
 	res = link_reset(link);
 	if (0 != res)
 		goto handle_error;
 
+	profile_end(link->profile, link->track, "link_open");
 	return link;
 
     handle_error:
+	profile_end(link->profile, link->track, "link_open");
     	link_close(link);
         return NULL;
 }
@@ -565,6 +1388,8 @@ int link_reset(link_t *link)
 {
 	int res, retries;
 
+	profile_begin(link->profile, link->track, "link_reset");
+
 	// reset gets an extra retry because the first time through we don't flush
 	// stale data!
 	for (retries=0; retries<4; retries++) {
@@ -574,20 +1399,26 @@ int link_reset(link_t *link)
 		// do_command is tri-state, both -1 (fatal) and 0 (success) should
 		// be passed up the stack.
 		if (res <= 0)
-			return res;
+			goto out;
 
 		// a recoverable error has occurred
 		TRACE("Recoverable error during reset (%s). Retrying...\n", strerror(errno));
 		assert(1 == res);
+		count_retry(link, "reset");
 	}
 
 	TRACE("Giving up after %d retries\n", retries);
+	link_failed(link);
 	errno = ENOLINK;
-	return -1;
+	res = -1;
+
+    out:
+	profile_end(link->profile, link->track, "link_reset");
+	return res;
 }
 
 
-int link_command(link_t *link, link_msg_t *input, link_msg_t *output)
+int link_command(link_t *link, const link_cmd_t *input, link_msg_t *output)
 {
 	int res, retries;
 
@@ -602,20 +1433,107 @@ int link_command(link_t *link, link_msg_t *input, link_msg_t *output)
 		// a recoverable error has occurred
 		TRACE("Recoverable error during command processing (%s). Retrying...\n", strerror(errno));
 		assert(1 == res);
+		count_retry(link, "command");
 		res = link_reset(link);
 		if (0 != res)
 			return res;
 	}
 
 	DEBUG("Giving up after %d retries\n", retries);
+	link_failed(link);
 	errno = ENOLINK;
 	return -1;
 }
 
+/**
+ * Store a little endian 16-bit value in the message of a prepared command.
+ *
+ * The CRC is linear so, rather than recalculating it, we checksum only the
+ * bytes that changed (XORed with their old values) and fold the result into
+ * the existing CRC. The delta runs from the patched bytes up to the ETX and,
+ * since it starts from zero, is the same for all four frames.
+ */
+void link_cmd_set_u16(link_cmd_t *cmd, unsigned int offset, uint16_t value)
+{
+	unsigned char delta[LINK_MAX_FRAME_LEN] = { 0 };
+	unsigned char *p = cmd->frames[0];
+
+	assert(offset + 2 <= cmd->msg_len);
+
+	delta[0] = p[OFFSET_MSG + offset] ^ (value & 0xff);
+	delta[1] = p[OFFSET_MSG + offset + 1] ^ (value >> 8);
+	if (!delta[0] && !delta[1])
+		return;
+
+	uint16_t fixup = crc_ccitt(0, delta, OFFSET_ETX(p) - (OFFSET_MSG + offset) + 1);
+
+	for (unsigned int i=0; i<4; i++) {
+		p = cmd->frames[i];
+		p[OFFSET_MSG + offset] = value & 0xff;
+		p[OFFSET_MSG + offset + 1] = value >> 8;
+		p[OFFSET_CRC_LO(p)] ^= fixup & 0xff;
+		p[OFFSET_CRC_HI(p)] ^= fixup >> 8;
+	}
+}
+
+/**
+ * Select between a fixed and an adaptive inter-packet guard period.
+ *
+ * Switching to adaptive mode takes effect gradually as turnaround samples
+ * are collected. Switching back to fixed mode restores the default guard
+ * period immediately.
+ */
+void link_set_adaptive_guard(link_t *link, bool adaptive)
+{
+	link->adaptive_guard = adaptive;
+	if (!adaptive)
+		link->guard = LINK_PACKET_TIMEOUT;
+}
+
+/**
+ * Get the link layer counters.
+ *
+ * Retries include retransmitted packets as well as repeated resets and
+ * commands. Frames that the framer rejects because their ETX or CRC is
+ * wrong are counted as CRC failures.
+ */
+void link_get_stats(link_t *link, link_stats_t *stats)
+{
+	*stats = link->stats;
+	stats->crc_failures += link->rx.rejected;
+}
+
+/**
+ * Add a span to the link's track in the profile (if there is one).
+ */
+void link_profile_begin(link_t *link, const char *name)
+{
+	profile_begin(link->profile, link->track, name);
+}
+
+void link_profile_end(link_t *link, const char *name)
+{
+	profile_end(link->profile, link->track, name);
+}
+
+/**
+ * Show the most recent link layer traffic.
+ */
+void link_dump_trace(link_t *link, FILE *f)
+{
+	tracering_dump(&link->ring, f);
+}
+
 void link_close(link_t *link)
 {
     	if (link->fd >= 0)
     		(void) close(link->fd);
+    	if (link->facade)
+    		facade_close(link->facade);
+    	if (link->replay)
+    		replay_close(link->replay);
+    	if (link->capture && 0 != capture_close(link->capture))
+    		ERROR("Cannot write capture file (%s)\n", strerror(errno));
         free(link);
 }
 
@@ -19,18 +19,64 @@
 #ifndef UE_LINK_H_
 #define UE_LINK_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "profile.h"
+
 #define LINK_MAX_MSG_LEN 34
 
+// this is an approximation (true value is closer to 800) but I wanted a margin for error
+#define LINK_US_PER_BYTE 1000
+
 typedef struct link_msg {
 	unsigned len;
 	unsigned char data[LINK_MAX_MSG_LEN];
 } link_msg_t;
 
+#define LINK_MAX_FRAME_LEN (LINK_MAX_MSG_LEN + 6)
+
+/*
+ * A command prepared ahead of time, fully framed for each combination of the
+ * link's E and S bits (indexed by (e << 1) | s). See commands.def.
+ */
+typedef struct link_cmd {
+	unsigned int msg_len;
+	unsigned char frames[4][LINK_MAX_FRAME_LEN];
+} link_cmd_t;
+
 typedef struct link link_t;
 
-link_t *link_open(const char *pathname);
+/* counters maintained by the link layer (see link_get_stats()) */
+typedef struct link_stats {
+	uint64_t packets_tx;
+	uint64_t packets_rx;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+	uint64_t crc_failures;
+	uint64_t timeouts;
+	uint64_t resets;
+	uint64_t retries;
+	uint64_t guard_sleep_us;
+} link_stats_t;
+
+link_t *link_open(const char *pathname, const char *capture, profile_t *profile);
 int link_reset(link_t *link);
-int link_command(link_t *link, link_msg_t *input, link_msg_t *output);
+int link_command(link_t *link, const link_cmd_t *input, link_msg_t *output);
+void link_set_adaptive_guard(link_t *link, bool adaptive);
+void link_dump_trace(link_t *link, FILE *f);
+void link_get_stats(link_t *link, link_stats_t *stats);
+void link_profile_begin(link_t *link, const char *name);
+void link_profile_end(link_t *link, const char *name);
 void link_close(link_t *link);
 
+int link_get_fd(link_t *link);
+int link_command_start(link_t *link, const link_cmd_t *input);
+int link_command_continue(link_t *link, link_msg_t *output);
+bool link_wants_input(link_t *link);
+uint64_t link_get_deadline(link_t *link);
+
+void link_cmd_set_u16(link_cmd_t *cmd, unsigned int offset, uint16_t value);
+
 #endif // UE_LINK_H_
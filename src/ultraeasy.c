@@ -18,32 +18,75 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "commands.h"
+#include "probes.h"
+#include "profile.h"
 #include "ultraeasy.h"
 #include "ue_link.h"
 #include "util.h"
 
+struct ultraeasy_profile {
+	profile_t *profile;
+};
+
 struct ultraeasy {
 	link_t *link;
+
+	// per-command latency (the link layer keeps the other counters)
+	ultraeasy_stats_t stats;
+
+	// when the current non-blocking command was started
+	uint64_t async_start;
+
+	// meter information that does not change while the meter is open
+	char *serial;
+	char *version;
+	int num_records;
+	bool have_units;
+	uint32_t units;
+};
+
+/* the name of each command's span in a profile */
+static const char *span_names[ULTRAEASY_NUM_COMMANDS] = {
+	[ULTRAEASY_CMD_READ_RTC] = "ultraeasy_read_rtc",
+	[ULTRAEASY_CMD_READ_VERSION] = "ultraeasy_read_version",
+	[ULTRAEASY_CMD_READ_SERIAL] = "ultraeasy_read_serial",
+	[ULTRAEASY_CMD_NUM_RECORDS] = "ultraeasy_num_records",
+	[ULTRAEASY_CMD_GET_RECORD] = "ultraeasy_get_record",
+	[ULTRAEASY_CMD_READ_UNITS] = "ultraeasy_read_units",
 };
 
-static int do_command(ultraeasy_t *ultraeasy,
-		      const unsigned char *cmdstr, unsigned int cmdlen,
-		      const unsigned char *replystr, unsigned int replylen,
-		      unsigned int expectedlen, link_msg_t *reply)
+/**
+ * Add a completed (or failed) command to the latency statistics.
+ */
+static void record_latency(ultraeasy_t *ultraeasy, ultraeasy_command_t command,
+			   uint64_t start, int res)
 {
-	link_msg_t cmd;
-	int res;
+	uint64_t latency = us_gettime(CLOCK_MONOTONIC) - start;
+	unsigned int bucket = 0;
 
-	memcpy(cmd.data, cmdstr, cmdlen);
-	cmd.len = cmdlen;
+	while (bucket < ULTRAEASY_LATENCY_BUCKETS - 1 && latency >= (1000ull << bucket))
+		bucket++;
 
-	res = link_command(ultraeasy->link, &cmd, reply);
+	PROBE3(command_done, command, latency, res);
+
+	ultraeasy_command_stats_t *stats = &ultraeasy->stats.commands[command];
+	stats->count++;
 	if (0 != res)
-		return res;
+		stats->failures++;
+	stats->total_us += latency;
+	if (latency > stats->max_us)
+		stats->max_us = latency;
+	stats->histogram[bucket]++;
+}
 
+static int check_reply(const unsigned char *replystr, unsigned int replylen,
+		       unsigned int expectedlen, link_msg_t *reply)
+{
 	if (reply->len < replylen) {
 		ERROR("Reply from meter is too short\n");
 		errno = EPROTO;
@@ -68,139 +111,521 @@ static int do_command(ultraeasy_t *ultraeasy,
 	return 0;
 }
 
-static uint16_t get_u16(unsigned char *p)
+/**
+ * Issue a prepared command (see commands.def) and check the reply.
+ */
+static int run_command(ultraeasy_t *ultraeasy, ultraeasy_command_t command, const link_cmd_t *cmd,
+		       const unsigned char *replystr, unsigned int replylen,
+		       unsigned int expectedlen, link_msg_t *reply)
 {
-	return (p[1] << 8) | p[0];
+	int res;
+
+	uint64_t start = us_gettime(CLOCK_MONOTONIC);
+	PROBE1(command_start, command);
+	link_profile_begin(ultraeasy->link, span_names[command]);
+	res = link_command(ultraeasy->link, cmd, reply);
+	link_profile_end(ultraeasy->link, span_names[command]);
+	record_latency(ultraeasy, command, start, res);
+	if (0 != res)
+		return res;
+
+	return check_reply(replystr, replylen, expectedlen, reply);
 }
 
-static uint32_t get_u32(unsigned char *p)
+ultraeasy_t *ultraeasy_open(const char *pathname)
 {
-	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+	return ultraeasy_open_capture(pathname, NULL);
 }
 
-ultraeasy_t *ultraeasy_open(const char *pathname)
+/**
+ * Open the meter and record all link traffic to a capture file.
+ *
+ * The capture can be played back by opening "replay:FILE" (with the
+ * original timing) or "replay-fast:FILE" (as fast as possible).
+ */
+ultraeasy_t *ultraeasy_open_capture(const char *pathname, const char *capture)
+{
+	return ultraeasy_open_profile(pathname, capture, NULL);
+}
+
+/**
+ * Open the meter, optionally recording link traffic to a capture file
+ * and/or the session's phases to a profile (either may be NULL).
+ */
+ultraeasy_t *ultraeasy_open_profile(const char *pathname, const char *capture,
+				    ultraeasy_profile_t *profile)
 {
 	ultraeasy_t *ultraeasy = xzalloc(sizeof(ultraeasy_t));
+	ultraeasy->num_records = -1;
 
-	ultraeasy->link = link_open(pathname);
+	ultraeasy->link = link_open(pathname, capture, profile ? profile->profile : NULL);
 	if (NULL == ultraeasy->link) {
 		free(ultraeasy);
 		return NULL;
 	}
 
-	// Force link layer to set E & S. This is a hack to account for the fact
-	// that some of the facade data is captured from a real meter and therefore
-	// the facade only react if E & S are set. The opposite case (when facade
-	// expect E & S are clear) is no problem because the timeout and reset
-	// logic will automatically causes the bits to be cleared.
-	//
-	// Eventually we'll get the facade to understand E & S bits and then
-	// we can remove this hack.
-	if (0 == strcmp(pathname, "facade"))
-		free(ultraeasy_read_serial(ultraeasy));
-
 	return ultraeasy;
 }
 
 time_t ultraeasy_read_rtc(ultraeasy_t *ultraeasy)
 {
-	const unsigned char cmdstr[] = { 0x05, 0x20, 0x02, 0x00, 0x00, 0x00, 0x00 };
 	const unsigned char replystr[] = { 0x05, 0x06 };
 
 	link_msg_t reply;
 
-	int res = do_command(ultraeasy, cmdstr, sizeof(cmdstr), replystr, sizeof(replystr), 6, &reply);
+	int res = run_command(ultraeasy, ULTRAEASY_CMD_READ_RTC, &command_frames[CMD_READ_RTC],
+			      replystr, sizeof(replystr), 6, &reply);
 	if (0 != res)
 		return (time_t) -1;
 
 	return get_u32(reply.data + 2);
 }
 
-char *ultraeasy_read_version(ultraeasy_t *ultraeasy)
+/**
+ * Copy the string that follows the reply tag out of a reply.
+ */
+static char *unpack_string(const link_msg_t *reply, unsigned int replylen)
+{
+	char *str = xzalloc(reply->len - replylen + 1);
+	memcpy(str, reply->data + replylen, reply->len - replylen);
+	str[reply->len - replylen] = '\0';
+
+	return str;
+}
+
+/**
+ * Get the meter's version (fetching it on first use).
+ */
+static const char *get_version(ultraeasy_t *ultraeasy)
 {
-	const unsigned char cmdstr[] = { 0x05, 0x0d, 0x02 };
 	const unsigned char replystr[] = { 0x05, 0x06, 0x11 };
 
 	link_msg_t reply;
 
-	int res = do_command(ultraeasy, cmdstr, sizeof(cmdstr), replystr, sizeof(replystr), 0, &reply);
+	if (ultraeasy->version)
+		return ultraeasy->version;
+
+	int res = run_command(ultraeasy, ULTRAEASY_CMD_READ_VERSION, &command_frames[CMD_READ_VERSION],
+			      replystr, sizeof(replystr), 0, &reply);
 	if (0 != res)
 		return NULL;
 
-	char *version = xzalloc(reply.len);
-	memcpy(version, reply.data + sizeof(replystr), reply.len - sizeof(replystr));
-	version[reply.len - sizeof(replystr)] = '\0';
+	ultraeasy->version = unpack_string(&reply, sizeof(replystr));
+	return ultraeasy->version;
+}
 
-	return version;
+char *ultraeasy_read_version(ultraeasy_t *ultraeasy)
+{
+	const char *version = get_version(ultraeasy);
+	return version ? xstrdup(version) : NULL;
 }
 
-char *ultraeasy_read_serial(ultraeasy_t *ultraeasy)
+/**
+ * Get the meter's serial number (fetching it on first use).
+ */
+static const char *get_serial(ultraeasy_t *ultraeasy)
 {
-#if 1
-	const unsigned char cmdstr[] = { 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00,
-			      	     0x84,0x6a, 0xe8, 0x73, 0x00 };
-#else
-	const unsigned char cmdstr[] = { 0x05, 0x0b, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-#endif
 	const unsigned char replystr[] = { 0x05, 0x06 };
 
 	link_msg_t reply;
 
-	int res = do_command(ultraeasy, cmdstr, sizeof(cmdstr), replystr, sizeof(replystr), 0, &reply);
+	if (ultraeasy->serial)
+		return ultraeasy->serial;
+
+	int res = run_command(ultraeasy, ULTRAEASY_CMD_READ_SERIAL, &command_frames[CMD_READ_SERIAL],
+			      replystr, sizeof(replystr), 0, &reply);
 	if (0 != res)
 		return NULL;
 
-	char *version = xzalloc(reply.len);
-	memcpy(version, reply.data + sizeof(replystr), reply.len - sizeof(replystr));
-	version[reply.len - sizeof(replystr)] = '\0';
+	ultraeasy->serial = unpack_string(&reply, sizeof(replystr));
+	return ultraeasy->serial;
+}
 
-	return version;
+char *ultraeasy_read_serial(ultraeasy_t *ultraeasy)
+{
+	const char *serial = get_serial(ultraeasy);
+	return serial ? xstrdup(serial) : NULL;
 }
 
+/**
+ * Get the number of records in the meter (fetching it on first use).
+ *
+ * The meter cannot take a reading while it is talking to us so the count
+ * stays valid for as long as the meter is open.
+ */
 int ultraeasy_num_records(ultraeasy_t *ultraeasy)
 {
-#if 0
-	const unsigned char cmdstr[] = { 0x05, 0x1f, 0xf5, 0x01 };
-#else
-	const unsigned char cmdstr[] = { 0x05, 0x1f, 0x00, 0x02 };
-#endif
 	const unsigned char replystr[] = { 0x05, 0x0f };
 	link_msg_t reply;
 
-	int res = do_command(ultraeasy, cmdstr, sizeof(cmdstr), replystr, sizeof(replystr), 4, &reply);
+	if (ultraeasy->num_records >= 0)
+		return ultraeasy->num_records;
+
+	int res = run_command(ultraeasy, ULTRAEASY_CMD_NUM_RECORDS, &command_frames[CMD_NUM_RECORDS],
+			      replystr, sizeof(replystr), 4, &reply);
 	if (0 != res)
 		return -1;
 
-	return get_u16(reply.data + 2);
+	ultraeasy->num_records = get_u16(reply.data + 2);
+	return ultraeasy->num_records;
 }
 
-int ultraeasy_get_record(ultraeasy_t *ultraeasy, unsigned int num, ultraeasy_record_t *record)
+/**
+ * Get the meter's display units (fetching them on first use).
+ */
+static int get_units(ultraeasy_t *ultraeasy, uint32_t *units)
 {
-	unsigned char cmdstr[] = { 0x05, 0x1f, 0x00, 0x00 };
 	const unsigned char replystr[] = { 0x05, 0x06 };
-
 	link_msg_t reply;
 
-	assert(num < 500);
+	if (!ultraeasy->have_units) {
+		int res = run_command(ultraeasy, ULTRAEASY_CMD_READ_UNITS,
+				      &command_frames[CMD_READ_UNITS], replystr,
+				      sizeof(replystr), 6, &reply);
+		if (0 != res)
+			return -1;
+
+		ultraeasy->units = get_u32(reply.data + 2);
+		ultraeasy->have_units = true;
+	}
+
+	*units = ultraeasy->units;
+	return 0;
+}
+
+/**
+ * Copy a cached string into a fixed size info field.
+ */
+static int copy_info_string(char *dst, const char *src)
+{
+	if (!src)
+		return -1;
+
+	snprintf(dst, ULTRAEASY_INFO_STRING_MAX, "%s", src);
+	return 0;
+}
+
+/**
+ * Read several items of meter information in a single pass.
+ *
+ * fields is a mask of ULTRAEASY_INFO_* flags. Only items that are not
+ * already known are fetched from the meter (everything except the clock is
+ * cached for as long as the meter is open). info->valid reports which items
+ * were read successfully.
+ *
+ * Returns 0 if every requested item was read and -1 otherwise.
+ */
+int ultraeasy_read_info(ultraeasy_t *ultraeasy, unsigned int fields, ultraeasy_info_t *info)
+{
+	int res = 0, error = 0;
+
+	memset(info, 0, sizeof(*info));
+
+	if (fields & ULTRAEASY_INFO_SERIAL) {
+		if (0 == copy_info_string(info->serial, get_serial(ultraeasy)))
+			info->valid |= ULTRAEASY_INFO_SERIAL;
+		else
+			error = errno;
+	}
+
+	if (fields & ULTRAEASY_INFO_VERSION) {
+		if (0 == copy_info_string(info->version, get_version(ultraeasy)))
+			info->valid |= ULTRAEASY_INFO_VERSION;
+		else
+			error = errno;
+	}
+
+	if (fields & ULTRAEASY_INFO_RTC) {
+		info->rtc = ultraeasy_read_rtc(ultraeasy);
+		if ((time_t) -1 != info->rtc)
+			info->valid |= ULTRAEASY_INFO_RTC;
+		else
+			error = errno;
+	}
+
+	if (fields & ULTRAEASY_INFO_NUM_RECORDS) {
+		info->num_records = ultraeasy_num_records(ultraeasy);
+		if (info->num_records >= 0)
+			info->valid |= ULTRAEASY_INFO_NUM_RECORDS;
+		else
+			error = errno;
+	}
+
+	if (fields & ULTRAEASY_INFO_UNITS) {
+		if (0 == get_units(ultraeasy, &info->units))
+			info->valid |= ULTRAEASY_INFO_UNITS;
+		else
+			error = errno;
+	}
+
+	if (error) {
+		errno = error;
+		res = -1;
+	}
+
+	return res;
+}
+
+static const unsigned char get_record_replystr[] = { 0x05, 0x06 };
+
+/* the meter's memory holds this many records */
+#define MAX_RECORDS 500
+
+static void set_record_num(unsigned int num, link_cmd_t *cmd)
+{
+	assert(num < MAX_RECORDS);
+
+	link_cmd_set_u16(cmd, 2, num);
+}
+
+static void pack_get_record(unsigned int num, link_cmd_t *cmd)
+{
+	*cmd = command_frames[CMD_GET_RECORD];
+	set_record_num(num, cmd);
+}
 
-	cmdstr[2] = num & 0xff;
-	cmdstr[3] = (num >> 8) & 0xff;
+/**
+ * Fill in a record from the raw values reported by the meter.
+ */
+void ultraeasy_record_from_raw(ultraeasy_record_t *record, uint32_t date, uint32_t reading)
+{
+	record->raw.date = date;
+	record->raw.reading = reading;
 
-	int res = do_command(ultraeasy, cmdstr, sizeof(cmdstr), replystr, sizeof(replystr), 10, &reply);
+	record->date = date;
+	record->mmol_per_litre = (double) reading / 18.0;
+}
+
+static void unpack_record(link_msg_t *reply, ultraeasy_record_t *record)
+{
+	ultraeasy_record_from_raw(record, get_u32(reply->data + 2), get_u32(reply->data + 6));
+}
+
+int ultraeasy_get_record(ultraeasy_t *ultraeasy, unsigned int num, ultraeasy_record_t *record)
+{
+	link_cmd_t cmd;
+	link_msg_t reply;
+
+	pack_get_record(num, &cmd);
+
+	int res = run_command(ultraeasy, ULTRAEASY_CMD_GET_RECORD, &cmd,
+			      get_record_replystr, sizeof(get_record_replystr), 10, &reply);
 	if (0 != res)
 		return -1;
 
-	record->raw.date = get_u32(reply.data + 2);
-	record->raw.reading = get_u32(reply.data + 6);
+	unpack_record(&reply, record);
+	return 0;
+}
+
+/**
+ * Fetch a run of records, calling fn for each one as soon as it arrives.
+ *
+ * Records are numbered newest first so, starting from zero, the readings
+ * arrive in reverse chronological order. fn returns 0 to continue or
+ * non-zero to stop early (in which case this function returns 0).
+ *
+ * Returns -1 if a record cannot be read (fn will have been called for
+ * every record before it).
+ */
+int ultraeasy_foreach_record(ultraeasy_t *ultraeasy, unsigned int first, unsigned int count,
+			     ultraeasy_record_fn_t fn, void *ctx)
+{
+	link_cmd_t cmd;
+	link_msg_t reply;
+	ultraeasy_record_t record;
+
+	if (first > MAX_RECORDS || count > MAX_RECORDS - first) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (0 == count)
+		return 0;
+
+	// the frames are copied once and then only the record number (and,
+	// incrementally, the CRC) changes
+	pack_get_record(first, &cmd);
+
+	for (unsigned int num = first; num < first + count; num++) {
+		set_record_num(num, &cmd);
+
+		int res = run_command(ultraeasy, ULTRAEASY_CMD_GET_RECORD, &cmd,
+				      get_record_replystr, sizeof(get_record_replystr), 10, &reply);
+		if (0 != res)
+			return -1;
+
+		unpack_record(&reply, &record);
+		if (0 != fn(ctx, num, &record))
+			break;
+	}
+
+	return 0;
+}
 
-	record->date = record->raw.date;
-	record->mmol_per_litre = (double) record->raw.reading / 18.0;
+typedef struct record_array {
+	ultraeasy_record_t *records;
+	unsigned int first;
+} record_array_t;
 
+static int store_record(void *ctx, unsigned int num, const ultraeasy_record_t *record)
+{
+	record_array_t *array = ctx;
+
+	array->records[num - array->first] = *record;
 	return 0;
 }
 
+/**
+ * Fetch count records (starting with record first) into an array.
+ */
+int ultraeasy_get_records(ultraeasy_t *ultraeasy, unsigned int first, unsigned int count,
+			  ultraeasy_record_t *records)
+{
+	record_array_t array = { .records = records, .first = first };
+
+	return ultraeasy_foreach_record(ultraeasy, first, count, store_record, &array);
+}
+
+int ultraeasy_get_fd(ultraeasy_t *ultraeasy)
+{
+	return link_get_fd(ultraeasy->link);
+}
+
+int ultraeasy_get_events(ultraeasy_t *ultraeasy)
+{
+	return link_wants_input(ultraeasy->link) ? POLLIN : 0;
+}
+
+int ultraeasy_get_timeout(ultraeasy_t *ultraeasy)
+{
+	uint64_t deadline = link_get_deadline(ultraeasy->link);
+	if (MS_ERR == deadline)
+		return -1;
+
+	int64_t timeout = deadline - ms_gettime(CLOCK_MONOTONIC);
+	if (timeout < 0)
+		return 0;
+
+	return timeout;
+}
+
+int ultraeasy_start_get_record(ultraeasy_t *ultraeasy, unsigned int num)
+{
+	link_cmd_t cmd;
+
+	pack_get_record(num, &cmd);
+	int res = link_command_start(ultraeasy->link, &cmd);
+	if (0 != res)
+		return res;
+
+	ultraeasy->async_start = us_gettime(CLOCK_MONOTONIC);
+	PROBE1(command_start, ULTRAEASY_CMD_GET_RECORD);
+	link_profile_begin(ultraeasy->link, span_names[ULTRAEASY_CMD_GET_RECORD]);
+	return 0;
+}
+
+int ultraeasy_continue_get_record(ultraeasy_t *ultraeasy, ultraeasy_record_t *record)
+{
+	link_msg_t reply;
+
+	int res = link_command_continue(ultraeasy->link, &reply);
+	if (res <= 0) {
+		link_profile_end(ultraeasy->link, span_names[ULTRAEASY_CMD_GET_RECORD]);
+		record_latency(ultraeasy, ULTRAEASY_CMD_GET_RECORD, ultraeasy->async_start, res);
+	}
+	if (0 != res)
+		return res;
+
+	res = check_reply(get_record_replystr, sizeof(get_record_replystr), 10, &reply);
+	if (0 != res)
+		return -1;
+
+	unpack_record(&reply, record);
+	return 0;
+}
+
+void ultraeasy_set_adaptive_guard(ultraeasy_t *ultraeasy, int adaptive)
+{
+	link_set_adaptive_guard(ultraeasy->link, adaptive);
+}
+
+/**
+ * Show the most recent link layer traffic (for post-mortem debugging).
+ */
+void ultraeasy_dump_trace(ultraeasy_t *ultraeasy, FILE *f)
+{
+	link_dump_trace(ultraeasy->link, f);
+}
+
+/**
+ * Get the performance counters for this meter (since it was opened).
+ */
+void ultraeasy_get_stats(ultraeasy_t *ultraeasy, ultraeasy_stats_t *stats)
+{
+	link_stats_t link_stats;
+
+	link_get_stats(ultraeasy->link, &link_stats);
+
+	*stats = ultraeasy->stats;
+	stats->packets_tx = link_stats.packets_tx;
+	stats->packets_rx = link_stats.packets_rx;
+	stats->bytes_tx = link_stats.bytes_tx;
+	stats->bytes_rx = link_stats.bytes_rx;
+	stats->crc_failures = link_stats.crc_failures;
+	stats->timeouts = link_stats.timeouts;
+	stats->resets = link_stats.resets;
+	stats->retries = link_stats.retries;
+	stats->guard_sleep_us = link_stats.guard_sleep_us;
+}
+
+const char *ultraeasy_command_name(ultraeasy_command_t command)
+{
+	static const char *names[ULTRAEASY_NUM_COMMANDS] = {
+		[ULTRAEASY_CMD_READ_RTC] = "read-rtc",
+		[ULTRAEASY_CMD_READ_VERSION] = "read-version",
+		[ULTRAEASY_CMD_READ_SERIAL] = "read-serial",
+		[ULTRAEASY_CMD_NUM_RECORDS] = "num-records",
+		[ULTRAEASY_CMD_GET_RECORD] = "get-record",
+		[ULTRAEASY_CMD_READ_UNITS] = "read-units",
+	};
+
+	if (command >= ULTRAEASY_NUM_COMMANDS)
+		return "unknown";
+
+	return names[command];
+}
+
+/**
+ * Create a profile (see ultraeasy_open_profile()).
+ */
+ultraeasy_profile_t *ultraeasy_profile_create(const char *pathname)
+{
+	profile_t *p = profile_create(pathname);
+	if (!p)
+		return NULL;
+
+	ultraeasy_profile_t *profile = xzalloc(sizeof(ultraeasy_profile_t));
+	profile->profile = p;
+	return profile;
+}
+
+/**
+ * Finish the profile. Returns -1 if it could not be written.
+ */
+int ultraeasy_profile_close(ultraeasy_profile_t *profile)
+{
+	if (!profile)
+		return 0;
+
+	int res = profile_close(profile->profile);
+	free(profile);
+	return res;
+}
+
 void ultraeasy_close(ultraeasy_t *ultraeasy)
 {
 	link_close(ultraeasy->link);
+	free(ultraeasy->serial);
+	free(ultraeasy->version);
 	free(ultraeasy);
 }
@@ -20,6 +20,7 @@
 #define ULTRAEASY_H_
 
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 #ifdef __cplusplus
@@ -27,6 +28,10 @@ extern “C” {
 #endif
 
 typedef struct ultraeasy ultraeasy_t;
+typedef struct ultraeasy_profile ultraeasy_profile_t;
+typedef struct ultraeasy_store ultraeasy_store_t;
+typedef struct ultraeasy_archive ultraeasy_archive_t;
+typedef struct ultraeasy_archive_writer ultraeasy_archive_writer_t;
 
 typedef struct ultraeasy_record {
 	time_t date;
@@ -38,14 +43,186 @@ typedef struct ultraeasy_record {
 	} raw;
 } ultraeasy_record_t;
 
+/* items of meter information (see ultraeasy_read_info()) */
+#define ULTRAEASY_INFO_SERIAL		(1 << 0)
+#define ULTRAEASY_INFO_VERSION		(1 << 1)
+#define ULTRAEASY_INFO_RTC		(1 << 2)
+#define ULTRAEASY_INFO_NUM_RECORDS	(1 << 3)
+#define ULTRAEASY_INFO_UNITS		(1 << 4)
+#define ULTRAEASY_INFO_ALL		((1 << 5) - 1)
+
+#define ULTRAEASY_INFO_STRING_MAX 40
+
+typedef struct ultraeasy_info {
+	unsigned int valid;	// the items that were read successfully
+
+	char serial[ULTRAEASY_INFO_STRING_MAX];
+	char version[ULTRAEASY_INFO_STRING_MAX];
+	time_t rtc;
+	int num_records;
+	uint32_t units;		// display units (0 is mg/dL, 1 is mmol/L)
+} ultraeasy_info_t;
+
+/* see ultraeasy_foreach_record() */
+typedef int (*ultraeasy_record_fn_t)(void *ctx, unsigned int num, const ultraeasy_record_t *record);
+
+/* see ultraeasy_archive_summarise() (readings are raw values) */
+typedef struct ultraeasy_summary {
+	unsigned long count;
+	uint32_t min_reading;
+	uint32_t max_reading;
+	uint64_t sum;
+
+	// how much of the archive had to be examined
+	unsigned int blocks_read;
+	unsigned int blocks_skipped;
+} ultraeasy_summary_t;
+
+/* see ultraeasy_store_foreach() and ultraeasy_archive_foreach() */
+typedef int (*ultraeasy_store_fn_t)(void *ctx, const char *serial, const ultraeasy_record_t *record);
+
+/* the commands whose latency is recorded by ultraeasy_get_stats() */
+typedef enum ultraeasy_command {
+	ULTRAEASY_CMD_READ_RTC,
+	ULTRAEASY_CMD_READ_VERSION,
+	ULTRAEASY_CMD_READ_SERIAL,
+	ULTRAEASY_CMD_NUM_RECORDS,
+	ULTRAEASY_CMD_GET_RECORD,
+	ULTRAEASY_CMD_READ_UNITS,
+	ULTRAEASY_NUM_COMMANDS
+} ultraeasy_command_t;
+
+/*
+ * Bucket 0 of a latency histogram counts commands that took less than 1ms,
+ * bucket n those that took less than 2^n ms and the last bucket everything
+ * else.
+ */
+#define ULTRAEASY_LATENCY_BUCKETS 16
+
+typedef struct ultraeasy_command_stats {
+	uint64_t count;
+	uint64_t failures;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t histogram[ULTRAEASY_LATENCY_BUCKETS];
+} ultraeasy_command_stats_t;
+
+typedef struct ultraeasy_stats {
+	uint64_t packets_tx;
+	uint64_t packets_rx;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+	uint64_t crc_failures;
+	uint64_t timeouts;
+	uint64_t resets;
+	uint64_t retries;
+	uint64_t guard_sleep_us;
+
+	ultraeasy_command_stats_t commands[ULTRAEASY_NUM_COMMANDS];
+} ultraeasy_stats_t;
+
 ultraeasy_t *ultraeasy_open(const char *pathname);
+ultraeasy_t *ultraeasy_open_capture(const char *pathname, const char *capture);
+ultraeasy_t *ultraeasy_open_profile(const char *pathname, const char *capture,
+				    ultraeasy_profile_t *profile);
 time_t ultraeasy_read_rtc(ultraeasy_t *ultraeasy);
 char *ultraeasy_read_serial(ultraeasy_t *ultraeasy);
 char *ultraeasy_read_version(ultraeasy_t *ultraeasy);
+int ultraeasy_read_info(ultraeasy_t *ultraeasy, unsigned int fields, ultraeasy_info_t *info);
 int ultraeasy_num_records(ultraeasy_t *ultraeasy);
 int ultraeasy_get_record(ultraeasy_t *ultraeasy, unsigned int num, ultraeasy_record_t *record);
+int ultraeasy_get_records(ultraeasy_t *ultraeasy, unsigned int first, unsigned int count,
+			  ultraeasy_record_t *records);
+int ultraeasy_foreach_record(ultraeasy_t *ultraeasy, unsigned int first, unsigned int count,
+			     ultraeasy_record_fn_t fn, void *ctx);
+void ultraeasy_set_adaptive_guard(ultraeasy_t *ultraeasy, int adaptive);
+void ultraeasy_dump_trace(ultraeasy_t *ultraeasy, FILE *f);
+void ultraeasy_get_stats(ultraeasy_t *ultraeasy, ultraeasy_stats_t *stats);
+const char *ultraeasy_command_name(ultraeasy_command_t command);
+void ultraeasy_record_from_raw(ultraeasy_record_t *record, uint32_t date, uint32_t reading);
+
+/*
+ * Timeline profiles.
+ *
+ * A profile records the phases of every session opened with it as a
+ * Trace Event Format (chrome://tracing) JSON file. One profile can be
+ * shared by several meters (each appears as a separate track), including
+ * meters used from different threads. The profile must outlive them all.
+ */
+ultraeasy_profile_t *ultraeasy_profile_create(const char *pathname);
+int ultraeasy_profile_close(ultraeasy_profile_t *profile);
 void ultraeasy_close(ultraeasy_t *ultraeasy);
 
+/*
+ * Reading stores.
+ *
+ * A store is an append-only file holding the readings from any number of
+ * meters, each reading kept once no matter how often it is downloaded.
+ * ultraeasy_store_add() returns 1 if the reading is new and 0 if it is
+ * already in the store. New readings become durable (all together) when
+ * ultraeasy_store_commit() returns; if it is never called they are
+ * discarded. A store may be shared by several threads but only one process
+ * can have a store open at a time.
+ */
+ultraeasy_store_t *ultraeasy_store_open(const char *pathname);
+int ultraeasy_store_add(ultraeasy_store_t *store, const char *serial,
+			const ultraeasy_record_t *record);
+int ultraeasy_store_commit(ultraeasy_store_t *store);
+unsigned long ultraeasy_store_count(ultraeasy_store_t *store);
+int ultraeasy_store_foreach(ultraeasy_store_t *store, ultraeasy_store_fn_t fn, void *ctx);
+int ultraeasy_store_close(ultraeasy_store_t *store);
+
+/*
+ * Reading archives.
+ *
+ * An archive is a compact, read-only copy of a collection of readings that
+ * is memory mapped by readers. Readings are stored once each, grouped by
+ * meter and in date order, however they were written.
+ */
+ultraeasy_archive_writer_t *ultraeasy_archive_create(const char *pathname);
+int ultraeasy_archive_write(ultraeasy_archive_writer_t *writer, const char *serial,
+			    const ultraeasy_record_t *record);
+int ultraeasy_archive_finish(ultraeasy_archive_writer_t *writer);
+void ultraeasy_archive_abandon(ultraeasy_archive_writer_t *writer);
+
+ultraeasy_archive_t *ultraeasy_archive_open(const char *pathname);
+unsigned long ultraeasy_archive_count(ultraeasy_archive_t *archive);
+int ultraeasy_archive_foreach(ultraeasy_archive_t *archive, ultraeasy_store_fn_t fn, void *ctx);
+int ultraeasy_archive_query(ultraeasy_archive_t *archive, const char *serial,
+			    time_t from, time_t to, ultraeasy_store_fn_t fn, void *ctx);
+int ultraeasy_archive_summarise(ultraeasy_archive_t *archive, const char *serial,
+				time_t from, time_t to, ultraeasy_summary_t *summary);
+void ultraeasy_archive_close(ultraeasy_archive_t *archive);
+
+/*
+ * Legacy ASCII databases.
+ *
+ * ultraeasy_load_adb() reads every reading from a file in the format written
+ * by ultraeasy --dump (and merged by ue-dbupdate), using up to threads
+ * threads (zero for one per processor). The result is a malloc'ed array.
+ */
+ultraeasy_record_t *ultraeasy_load_adb(const char *pathname, unsigned int threads,
+				       unsigned long *num_records);
+
+/*
+ * Non-blocking interface.
+ *
+ * ultraeasy_start_get_record() begins fetching a record and
+ * ultraeasy_continue_get_record() advances the exchange without blocking.
+ * The latter returns 0 when the record is complete, 1 if the exchange is
+ * still in progress and -1 on error.
+ *
+ * Between calls the caller should wait (using poll(), epoll_wait(), etc.)
+ * for the events reported by ultraeasy_get_events() on the file descriptor
+ * reported by ultraeasy_get_fd(), but for no longer than the timeout (in
+ * milliseconds) reported by ultraeasy_get_timeout().
+ */
+int ultraeasy_get_fd(ultraeasy_t *ultraeasy);
+int ultraeasy_get_events(ultraeasy_t *ultraeasy);
+int ultraeasy_get_timeout(ultraeasy_t *ultraeasy);
+int ultraeasy_start_get_record(ultraeasy_t *ultraeasy, unsigned int num);
+int ultraeasy_continue_get_record(ultraeasy_t *ultraeasy, ultraeasy_record_t *record);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -89,6 +89,76 @@ uint64_t ms_gettime(clockid_t clk_id)
 	return timespec_to_ms(&ts);
 }
 
+uint64_t us_gettime(clockid_t clk_id)
+{
+	struct timespec ts;
+	int res = clock_gettime(clk_id, &ts);
+	if (0 != res)
+		return MS_ERR;
+
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * Sleep until the supplied clock reaches an absolute deadline.
+ *
+ * Sleeping against an absolute deadline (rather than for a relative
+ * interval) means that oversleeping on one call is not added to the
+ * next one.
+ */
+int ms_sleep_until(clockid_t clk_id, uint64_t deadline)
+{
+	struct timespec ts;
+	int res;
+
+	ms_to_timespec(deadline, &ts);
+
+	do {
+		res = clock_nanosleep(clk_id, TIMER_ABSTIME, &ts, NULL);
+	} while (EINTR == res);
+
+	if (0 != res) {
+		errno = res;
+		return -1;
+	}
+
+	return 0;
+}
+
+int us_sleep_until(clockid_t clk_id, uint64_t deadline)
+{
+	struct timespec ts = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 };
+	int res;
+
+	do {
+		res = clock_nanosleep(clk_id, TIMER_ABSTIME, &ts, NULL);
+	} while (EINTR == res);
+
+	if (0 != res) {
+		errno = res;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Convert a UTC date and time into seconds since the epoch.
+ *
+ * This is timegm() (which POSIX lacks) using the days-from-civil algorithm.
+ */
+time_t utc_time(int year, int month, int day, int hour, int min, int sec)
+{
+	year -= month <= 2;
+	int era = (year >= 0 ? year : year - 399) / 400;
+	int yoe = year - era * 400;
+	int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	long long days = era * 146097LL + doe - 719468;
+
+	return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
 char *strdup_asciify(const unsigned char *p, unsigned int len)
 {
 	char *s, *ret;
@@ -173,6 +243,14 @@ void *xzalloc(size_t size)
 	return m;
 }
 
+void *xrealloc(void *ptr, size_t size)
+{
+	void *m = realloc(ptr, size);
+	if (NULL == m)
+		fatal("Out of memory");
+	return m;
+}
+
 char *xstrdup(const char *str)
 {
 	char *s = strdup(str);
@@ -215,12 +293,12 @@ char *strdup_vprintf(const char *fmt, va_list ap)
 	int len;
 	char *s;
 
-	va_copy(ap, cp);
+	va_copy(cp, ap);
 	len = vsnprintf(NULL, 0, fmt, cp);
+	va_end(cp);
 	assert(len >= 0);
 	if (len < 0)
 		return NULL;
-	va_end(cp);
 
 	s = malloc(len+1);
 	if (NULL == s)
@@ -38,6 +38,46 @@ void fatal(const char *fmt, ...);
 uint64_t timespec_to_ms(const struct timespec *tp);
 void ms_to_timespec(uint64_t ms, struct timespec *tp);
 uint64_t ms_gettime(clockid_t clk_id);
+uint64_t us_gettime(clockid_t clk_id);
+int ms_sleep_until(clockid_t clk_id, uint64_t deadline);
+int us_sleep_until(clockid_t clk_id, uint64_t deadline);
+time_t utc_time(int year, int month, int day, int hour, int min, int sec);
+
+/*
+ * Little endian integers (as used by the meter and by our file formats).
+ */
+static inline void put_u16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v)
+{
+	for (int i=0; i<4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v)
+{
+	for (int i=0; i<8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static inline uint16_t get_u16(const unsigned char *p)
+{
+	return (p[1] << 8) | p[0];
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+	return ((uint32_t) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static inline uint64_t get_u64(const unsigned char *p)
+{
+	return ((uint64_t) get_u32(p + 4) << 32) | get_u32(p);
+}
 
 /**
  * printf() to log file
@@ -54,6 +94,7 @@ char *strdup_hexdump(const unsigned char *p, unsigned int len);
 char *xstrdup_hexdump(const unsigned char *p, unsigned int len);
 
 void *xzalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
 char *xstrdup(const char *str);
 
 char *strdup_printf(const char *fmt, ...);